@@ -4,6 +4,31 @@
 #include <thread>
 #include <vector>
 #include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <map>
+#include <list>
+#include <algorithm>
+#include <array>
+#include <iterator>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <malloc.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <termios.h>
 using namespace std;
 
 
@@ -27,8 +52,491 @@ struct AVLNode
     AVLNode *left;
     AVLNode *right;
     int height;
+    uint32_t doc = 0; // id in the query indexes, once they are built
 };
 
+// Hot-path counters. Build with -DCATALOG_COUNTERS to enable them; otherwise
+// COUNT and COUNT_TIME expand to nothing and cost nothing. Each thread bumps
+// its own slots (relaxed load + store, no locked instructions) and
+// readCounters sums every thread, including ones that have exited.
+enum Counter
+{
+    COMPARISONS,
+    NODES_VISITED,
+    LEFT_ROTATIONS,
+    RIGHT_ROTATIONS,
+    BYTES_ALLOCATED,
+    INSERT_NS,
+    DELETE_NS,
+    LOOKUP_NS,
+    SEARCH_NS,
+    COUNTER_COUNT
+};
+
+const char *const counterNames[COUNTER_COUNT] = {
+    "comparisons", "nodes visited", "left rotations", "right rotations", "bytes allocated",
+    "insert time (ns)", "delete time (ns)", "lookup time (ns)", "search time (ns)"};
+
+#ifdef CATALOG_COUNTERS
+struct ThreadCounters;
+mutex countersLock;
+vector<ThreadCounters *> liveCounters;
+array<uint64_t, COUNTER_COUNT> retiredCounters = {};
+
+struct ThreadCounters
+{
+    array<atomic<uint64_t>, COUNTER_COUNT> values = {};
+
+    ThreadCounters()
+    {
+        lock_guard<mutex> guard(countersLock);
+        liveCounters.push_back(this);
+    }
+
+    ~ThreadCounters()
+    {
+        lock_guard<mutex> guard(countersLock);
+        for (int c = 0; c < COUNTER_COUNT; c++)
+            retiredCounters[c] += values[c].load(memory_order_relaxed);
+        liveCounters.erase(find(liveCounters.begin(), liveCounters.end(), this));
+    }
+};
+
+thread_local ThreadCounters threadCounters;
+
+inline void countAdd(Counter counter, uint64_t n)
+{
+    atomic<uint64_t> &value = threadCounters.values[counter];
+    value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+struct CountTimer
+{
+    Counter counter;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    ~CountTimer()
+    {
+        countAdd(counter, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+};
+
+#define COUNT(counter, n) countAdd(counter, n)
+#define COUNT_TIME(counter) CountTimer countTimer{counter}
+#else
+#define COUNT(counter, n) ((void)0)
+#define COUNT_TIME(counter) ((void)0)
+#endif
+
+bool countersEnabled()
+{
+#ifdef CATALOG_COUNTERS
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Totals over all threads; all zero when the counters are compiled out
+array<uint64_t, COUNTER_COUNT> readCounters()
+{
+    array<uint64_t, COUNTER_COUNT> totals = {};
+#ifdef CATALOG_COUNTERS
+    lock_guard<mutex> guard(countersLock);
+    totals = retiredCounters;
+    for (ThreadCounters *counters : liveCounters)
+        for (int c = 0; c < COUNTER_COUNT; c++)
+            totals[c] += counters->values[c].load(memory_order_relaxed);
+#endif
+    return totals;
+}
+
+void resetCounters()
+{
+#ifdef CATALOG_COUNTERS
+    lock_guard<mutex> guard(countersLock);
+    retiredCounters = {};
+    for (ThreadCounters *counters : liveCounters)
+        for (atomic<uint64_t> &value : counters->values)
+            value.store(0, memory_order_relaxed);
+#endif
+}
+
+// Per-operation latency histograms, always on. Buckets are log-linear like
+// HdrHistogram: 8 linear sub-buckets per power of two, so any recorded value
+// is off by at most 12.5%. Each thread records into its own histograms with
+// relaxed load/store, so a sample is a few instructions and never contends.
+enum LatencyOp
+{
+    OP_ADD,
+    OP_REMOVE,
+    OP_FIND,
+    OP_PREFIX,
+    OP_KEYWORD,
+    OP_TRAVERSE,
+    OP_QUERY,
+    OP_RANKED,
+    OP_FUZZY,
+    OP_COMPLETE,
+    OP_IMPORT,
+    LATENCY_OP_COUNT
+};
+
+const char *const latencyOpNames[LATENCY_OP_COUNT] = {
+    "add", "remove", "find", "prefix search", "keyword search", "traversal", "query", "ranked search", "fuzzy lookup",
+    "autocomplete", "import"};
+
+const int LATENCY_SUB_BITS = 3;
+const int LATENCY_BUCKETS = (64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS;
+
+inline int latencyBucket(uint64_t ns)
+{
+    if (ns < (1u << LATENCY_SUB_BITS))
+        return (int)ns;
+    int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + (int)((ns >> shift) & ((1u << LATENCY_SUB_BITS) - 1));
+}
+
+// Smallest value that lands in bucket
+uint64_t latencyBucketValue(int bucket)
+{
+    if (bucket < (1 << LATENCY_SUB_BITS))
+        return bucket;
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    return (uint64_t)((1 << LATENCY_SUB_BITS) + (bucket & ((1 << LATENCY_SUB_BITS) - 1))) << shift;
+}
+
+struct ThreadLatencies;
+mutex latenciesLock;
+vector<ThreadLatencies *> liveLatencies;
+vector<uint64_t> retiredLatencies(LATENCY_OP_COUNT * LATENCY_BUCKETS);
+
+struct ThreadLatencies
+{
+    array<atomic<uint64_t>, LATENCY_OP_COUNT * LATENCY_BUCKETS> buckets = {};
+
+    ThreadLatencies()
+    {
+        lock_guard<mutex> guard(latenciesLock);
+        liveLatencies.push_back(this);
+    }
+
+    ~ThreadLatencies()
+    {
+        lock_guard<mutex> guard(latenciesLock);
+        for (size_t b = 0; b < buckets.size(); b++)
+            retiredLatencies[b] += buckets[b].load(memory_order_relaxed);
+        liveLatencies.erase(find(liveLatencies.begin(), liveLatencies.end(), this));
+    }
+};
+
+thread_local ThreadLatencies threadLatencies;
+
+inline void recordLatency(LatencyOp op, uint64_t ns)
+{
+    atomic<uint64_t> &bucket = threadLatencies.buckets[op * LATENCY_BUCKETS + latencyBucket(ns)];
+    bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+// Workload recording (--record FILE). Every outermost timed operation is
+// appended to a compact binary trace: WORKLOAD_MAGIC, then per operation a
+// type byte, the zigzag varint start time relative to the previous record,
+// a varint duration and the arguments as varint-length strings (the nine
+// book fields for add, nothing for a traversal, one string otherwise; a
+// find or remove naming an edition puts its ISBN and a tab before the title).
+// Times are nanoseconds. Records are buffered and written in 1 MiB chunks.
+const char WORKLOAD_MAGIC[8] = {'A', 'V', 'L', 'W', 'K', 'L', '1', '\n'};
+
+struct WorkloadRecorder
+{
+    mutex lock;
+    ofstream file;
+    string buffer;
+    chrono::steady_clock::time_point epoch;
+    int64_t lastStart = 0;
+};
+
+atomic<bool> recordingEnabled(false);
+WorkloadRecorder workloadRecorder;
+
+void putVarint(string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+bool getVarint(const char *&p, const char *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void putVarString(string &out, const string &value)
+{
+    putVarint(out, value.size());
+    out += value;
+}
+
+bool startRecording(const string &path)
+{
+    WorkloadRecorder &rec = workloadRecorder;
+    rec.file.open(path, ios::binary | ios::trunc);
+    if (!rec.file)
+        return false;
+    rec.file.write(WORKLOAD_MAGIC, sizeof(WORKLOAD_MAGIC));
+    rec.epoch = chrono::steady_clock::now();
+    recordingEnabled.store(true);
+    return true;
+}
+
+bool stopRecording()
+{
+    WorkloadRecorder &rec = workloadRecorder;
+    recordingEnabled.store(false);
+    lock_guard<mutex> guard(rec.lock);
+    rec.file.write(rec.buffer.data(), rec.buffer.size());
+    rec.buffer.clear();
+    rec.file.close();
+    return !rec.file.fail();
+}
+
+void recordOperation(LatencyOp op, chrono::steady_clock::time_point start, uint64_t ns, const Book *book,
+                     const string *arg)
+{
+    WorkloadRecorder &rec = workloadRecorder;
+    lock_guard<mutex> guard(rec.lock);
+    int64_t at = chrono::duration_cast<chrono::nanoseconds>(start - rec.epoch).count();
+    int64_t delta = at - rec.lastStart;
+    rec.lastStart = at;
+    rec.buffer += (char)op;
+    putVarint(rec.buffer, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    putVarint(rec.buffer, ns);
+    if (book)
+        for (const string *field : {&book->title, &book->author, &book->publisher, &book->month, &book->day,
+                                    &book->year, &book->isbn, &book->category, &book->callNumber})
+            putVarString(rec.buffer, *field);
+    if (arg)
+        putVarString(rec.buffer, *arg);
+    if (rec.buffer.size() >= (1 << 20))
+    {
+        rec.file.write(rec.buffer.data(), rec.buffer.size());
+        rec.buffer.clear();
+    }
+}
+
+// Timers open on this thread; only the outermost one is traced, so an
+// operation built on another public one replays once
+thread_local int timerDepth = 0;
+
+// Records the lifetime of the scope as one sample of op and, while a
+// workload is being recorded, appends op and its argument to the trace
+// unless it runs inside another timed operation
+struct LatencyTimer
+{
+    LatencyOp op;
+    chrono::steady_clock::time_point start;
+    const Book *book;
+    const string *arg;
+    bool outermost;
+
+    explicit LatencyTimer(LatencyOp o, const string *a = nullptr)
+        : op(o), start(chrono::steady_clock::now()), book(nullptr), arg(a), outermost(timerDepth++ == 0) {}
+    LatencyTimer(LatencyOp o, const Book *b)
+        : op(o), start(chrono::steady_clock::now()), book(b), arg(nullptr), outermost(timerDepth++ == 0) {}
+
+    ~LatencyTimer()
+    {
+        timerDepth--;
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        recordLatency(op, ns);
+        if (outermost && recordingEnabled.load(memory_order_relaxed))
+            recordOperation(op, start, ns, book, arg);
+    }
+};
+
+struct LatencySummary
+{
+    uint64_t count = 0;
+    uint64_t p50 = 0, p90 = 0, p99 = 0, p999 = 0, max = 0; // nanoseconds
+};
+
+// Merges every thread's histogram for op and reads the percentiles off it
+LatencySummary latencySummary(LatencyOp op)
+{
+    vector<uint64_t> merged(LATENCY_BUCKETS);
+    {
+        lock_guard<mutex> guard(latenciesLock);
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            merged[b] = retiredLatencies[op * LATENCY_BUCKETS + b];
+        for (ThreadLatencies *thread : liveLatencies)
+            for (int b = 0; b < LATENCY_BUCKETS; b++)
+                merged[b] += thread->buckets[op * LATENCY_BUCKETS + b].load(memory_order_relaxed);
+    }
+    LatencySummary summary;
+    for (uint64_t n : merged)
+        summary.count += n;
+    const double quantiles[] = {0.50, 0.90, 0.99, 0.999};
+    uint64_t *targets[] = {&summary.p50, &summary.p90, &summary.p99, &summary.p999};
+    uint64_t seen = 0;
+    int q = 0;
+    for (int b = 0; b < LATENCY_BUCKETS && summary.count; b++)
+    {
+        if (!merged[b])
+            continue;
+        seen += merged[b];
+        for (; q < 4 && seen >= quantiles[q] * summary.count; q++)
+            *targets[q] = latencyBucketValue(b);
+        summary.max = latencyBucketValue(b + 1) - 1;
+    }
+    return summary;
+}
+
+void resetLatencies()
+{
+    lock_guard<mutex> guard(latenciesLock);
+    fill(retiredLatencies.begin(), retiredLatencies.end(), 0);
+    for (ThreadLatencies *thread : liveLatencies)
+        for (atomic<uint64_t> &bucket : thread->buckets)
+            bucket.store(0, memory_order_relaxed);
+}
+
+void dumpLatencies(ostream &out)
+{
+    out << setw(16) << left << "operation" << setw(10) << "count" << setw(10) << "p50(ns)" << setw(10) << "p90(ns)"
+        << setw(10) << "p99(ns)" << setw(10) << "p999(ns)" << "max(ns)\n";
+    for (int op = 0; op < LATENCY_OP_COUNT; op++)
+    {
+        LatencySummary s = latencySummary((LatencyOp)op);
+        out << setw(16) << left << latencyOpNames[op] << setw(10) << s.count << setw(10) << s.p50 << setw(10) << s.p90
+            << setw(10) << s.p99 << setw(10) << s.p999 << s.max << "\n";
+    }
+}
+
+// Opt-in tracing (--trace FILE). TRACE_SPAN records the enclosing scope as a
+// Chrome "complete" event into a per-thread ring of the most recent
+// TRACE_RING_SIZE spans. writeTrace merges the rings into a JSON file that
+// chrome://tracing and Perfetto open directly. When tracing is off a span
+// is one relaxed load and a branch.
+const size_t TRACE_RING_SIZE = 1 << 16;
+
+struct TraceEvent
+{
+    const char *name; // string literal
+    uint64_t start;   // ns since tracing started
+    uint64_t duration;
+};
+
+atomic<bool> tracingEnabled(false);
+chrono::steady_clock::time_point traceEpoch;
+
+struct ThreadTrace;
+mutex tracesLock;
+vector<ThreadTrace *> liveTraces;
+vector<pair<uint32_t, TraceEvent>> retiredTraceEvents;
+uint32_t nextTraceThread = 1;
+
+struct ThreadTrace
+{
+    vector<TraceEvent> ring;
+    size_t written = 0;
+    uint32_t tid;
+
+    ThreadTrace()
+    {
+        lock_guard<mutex> guard(tracesLock);
+        tid = nextTraceThread++;
+        liveTraces.push_back(this);
+    }
+
+    ~ThreadTrace()
+    {
+        lock_guard<mutex> guard(tracesLock);
+        for (size_t i = written > ring.size() ? written - ring.size() : 0; i < written; i++)
+            retiredTraceEvents.push_back({tid, ring[i % TRACE_RING_SIZE]});
+        liveTraces.erase(find(liveTraces.begin(), liveTraces.end(), this));
+    }
+
+    void add(const TraceEvent &event)
+    {
+        if (ring.size() < TRACE_RING_SIZE)
+            ring.push_back(event);
+        else
+            ring[written % TRACE_RING_SIZE] = event;
+        written++;
+    }
+};
+
+thread_local ThreadTrace threadTrace;
+
+uint64_t traceNow()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - traceEpoch).count();
+}
+
+struct TraceSpan
+{
+    const char *name;
+    uint64_t start;
+    bool active;
+
+    explicit TraceSpan(const char *spanName) : name(spanName), start(0), active(tracingEnabled.load(memory_order_relaxed))
+    {
+        if (active)
+            start = traceNow();
+    }
+
+    ~TraceSpan()
+    {
+        if (active)
+            threadTrace.add({name, start, traceNow() - start});
+    }
+};
+
+#define TRACE_CONCAT(a, b) a##b
+#define TRACE_NAME(line) TRACE_CONCAT(traceSpan, line)
+#define TRACE_SPAN(name) TraceSpan TRACE_NAME(__LINE__)(name)
+
+void startTracing()
+{
+    traceEpoch = chrono::steady_clock::now();
+    tracingEnabled.store(true);
+}
+
+// Call while no traced operation is running; rings are read without locks
+bool writeTrace(const string &path)
+{
+    vector<pair<uint32_t, TraceEvent>> events;
+    {
+        lock_guard<mutex> guard(tracesLock);
+        events = retiredTraceEvents;
+        for (ThreadTrace *trace : liveTraces)
+            for (size_t i = trace->written > trace->ring.size() ? trace->written - trace->ring.size() : 0;
+                 i < trace->written; i++)
+                events.push_back({trace->tid, trace->ring[i % TRACE_RING_SIZE]});
+    }
+    sort(events.begin(), events.end(), [](const pair<uint32_t, TraceEvent> &a, const pair<uint32_t, TraceEvent> &b)
+         { return a.second.start < b.second.start; });
+    ofstream out(path);
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++)
+        out << (i ? ",\n" : "\n") << "{\"name\":\"" << events[i].second.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+            << events[i].first << ",\"ts\":" << events[i].second.start / 1000.0
+            << ",\"dur\":" << events[i].second.duration / 1000.0 << "}";
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    return (bool)out;
+}
+
 int getHeight(AVLNode *node)
 {
     return node ? node->height : 0;
@@ -49,20 +557,73 @@ string toLower(const string &str)
     string lower = str;
     for (char &c : lower)
         c = tolower(c);
+    COUNT(BYTES_ALLOCATED, lower.size() > 15 ? lower.capacity() + 1 : 0);
     return lower;
 }
 
+// Case-insensitive title order without building lower-case copies. Folds
+// ASCII only, exactly like toLower in the default "C" locale; constexpr so the
+// seed image below can be sorted at compile time.
+constexpr array<unsigned char, 256> makeFoldTable()
+{
+    array<unsigned char, 256> table = {};
+    for (int c = 0; c < 256; c++)
+        table[c] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    return table;
+}
+
+constexpr array<unsigned char, 256> foldTable = makeFoldTable();
+
+constexpr int compareTitles(string_view a, string_view b)
+{
+    size_t n = a.size() < b.size() ? a.size() : b.size();
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char ca = foldTable[(unsigned char)a[i]], cb = foldTable[(unsigned char)b[i]];
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+    return a.size() == b.size() ? 0 : (a.size() < b.size() ? -1 : 1);
+}
+
+// What tells two books apart. KEY_TITLE keeps one book per title;
+// KEY_TITLE_ISBN keys on (folded title, ISBN), so editions sharing a title
+// coexist. Either way books sort by title first, so a title's editions sit
+// next to each other and every title range query works unchanged.
+enum KeyPolicy : uint32_t
+{
+    KEY_TITLE,
+    KEY_TITLE_ISBN
+};
+
+int compareKeys(string_view titleA, string_view isbnA, string_view titleB, string_view isbnB, KeyPolicy keys)
+{
+    int cmp = compareTitles(titleA, titleB);
+    if (cmp || keys == KEY_TITLE)
+        return cmp;
+    return isbnA < isbnB ? -1 : (isbnA == isbnB ? 0 : 1);
+}
+
+// Orders a search key against a book: by title alone when isbn is null
+int compareKey(string_view title, const string *isbn, const Book &book)
+{
+    return isbn ? compareKeys(title, *isbn, book.title, book.isbn, KEY_TITLE_ISBN) : compareTitles(title, book.title);
+}
+
 AVLNode *createNode(Book book)
 {
     AVLNode *node = new AVLNode;
     node->book = book;
     node->left = node->right = nullptr;
     node->height = 1;
+    COUNT(BYTES_ALLOCATED, sizeof(AVLNode));
     return node;
 }
 
 AVLNode *rightRotate(AVLNode *y)
 {
+    TRACE_SPAN("rebalance");
+    COUNT(RIGHT_ROTATIONS, 1);
     AVLNode *x = y->left;
     AVLNode *T2 = x->right;
     x->right = y;
@@ -74,6 +635,8 @@ AVLNode *rightRotate(AVLNode *y)
 
 AVLNode *leftRotate(AVLNode *x)
 {
+    TRACE_SPAN("rebalance");
+    COUNT(LEFT_ROTATIONS, 1);
     AVLNode *y = x->right;
     AVLNode *T2 = y->left;
     y->left = x;
@@ -83,28 +646,33 @@ AVLNode *leftRotate(AVLNode *x)
     return y;
 }
 
-AVLNode *insert(AVLNode *node, Book book)
+// A book whose key is already in the tree is dropped
+AVLNode *insert(AVLNode *node, Book book, KeyPolicy keys = KEY_TITLE)
 {
     if (!node)
         return createNode(book);
-    if (toLower(book.title) < toLower(node->book.title))
-        node->left = insert(node->left, book);
-    else if (toLower(book.title) > toLower(node->book.title))
-        node->right = insert(node->right, book);
+    COUNT(NODES_VISITED, 1);
+    COUNT(COMPARISONS, 1);
+    int cmp = compareKeys(book.title, book.isbn, node->book.title, node->book.isbn, keys);
+    if (cmp < 0)
+        node->left = insert(node->left, book, keys);
+    else if (cmp > 0)
+        node->right = insert(node->right, book, keys);
     else
         return node;
+    auto before = [&](AVLNode *other) { return compareKeys(book.title, book.isbn, other->book.title, other->book.isbn, keys) < 0; };
     node->height = max(getHeight(node->left), getHeight(node->right)) + 1;
     int balance = getBalance(node);
-    if (balance > 1 && toLower(book.title) < toLower(node->left->book.title))
+    if (balance > 1 && before(node->left))
         return rightRotate(node);
-    if (balance < -1 && toLower(book.title) > toLower(node->right->book.title))
+    if (balance < -1 && !before(node->right))
         return leftRotate(node);
-    if (balance > 1 && toLower(book.title) > toLower(node->left->book.title))
+    if (balance > 1 && !before(node->left))
     {
         node->left = leftRotate(node->left);
         return rightRotate(node);
     }
-    if (balance < -1 && toLower(book.title) < toLower(node->right->book.title))
+    if (balance < -1 && before(node->right))
     {
         node->right = rightRotate(node->right);
         return leftRotate(node);
@@ -120,38 +688,31 @@ AVLNode *minValueNode(AVLNode *node)
     return current;
 }
 
-AVLNode *deleteNode(AVLNode *root, string title)
+AVLNode *removeMin(AVLNode *node, AVLNode *&minNode);
+
+// Nodes are relinked rather than having books copied between them, so a
+// book keeps its node (and address) until it is removed. With isbn the
+// book keyed (title, isbn) is removed; without it, one titled title.
+AVLNode *deleteNode(AVLNode *root, const string &title, const string *isbn = nullptr)
 {
     if (!root)
         return root;
-    string target = toLower(title);
-    string current = toLower(root->book.title);
-    if (target < current)
-        root->left = deleteNode(root->left, title);
-    else if (target > current)
-        root->right = deleteNode(root->right, title);
+    COUNT(NODES_VISITED, 1);
+    COUNT(COMPARISONS, 1);
+    int cmp = compareKey(title, isbn, root->book);
+    if (cmp < 0)
+        root->left = deleteNode(root->left, title, isbn);
+    else if (cmp > 0)
+        root->right = deleteNode(root->right, title, isbn);
     else
     {
-        if (!root->left || !root->right)
-        {
-            AVLNode *temp = root->left ? root->left : root->right;
-            if (!temp)
-            {
-                delete root;
-                return nullptr;
-            }
-            else
-            {
-                *root = *temp;
-                delete temp;
-            }
-        }
-        else
-        {
-            AVLNode *temp = minValueNode(root->right);
-            root->book = temp->book;
-            root->right = deleteNode(root->right, temp->book.title);
-        }
+        AVLNode *left = root->left, *right = root->right;
+        delete root;
+        if (!left || !right)
+            return left ? left : right;
+        right = removeMin(right, root);
+        root->left = left;
+        root->right = right;
     }
     if (!root)
         return root;
@@ -174,49 +735,3227 @@ AVLNode *deleteNode(AVLNode *root, string title)
     return root;
 }
 
-void displayBook(const Book &book)
+// Frees a whole subtree and returns how many books it held
+int freeTree(AVLNode *node)
 {
-    cout << "\t\t\t\t\t\t\t-------------------------------\n";
-    cout << "\t\t\t\t\t\t\tTitle: " << book.title << "\n";
-    cout << "\t\t\t\t\t\t\tAuthor: " << book.author << "\n";
-    cout << "\t\t\t\t\t\t\tPublisher: " << book.publisher << "\n";
-    cout << "\t\t\t\t\t\t\tDate: " << book.month << " " << book.day << ", " << book.year << "\n";
-    cout << "\t\t\t\t\t\t\tISBN: " << book.isbn << "\n";
-    cout << "\t\t\t\t\t\t\tCategory: " << book.category << "\n";
-    cout << "\t\t\t\t\t\t\tCall Number: " << book.callNumber << "\n";  // last displayed
+    if (!node)
+        return 0;
+    int freed = 1 + freeTree(node->left) + freeTree(node->right);
+    delete node;
+    return freed;
+}
+
+// Restores the AVL property at one node after a join or split step
+AVLNode *rebalance(AVLNode *node)
+{
+    node->height = max(getHeight(node->left), getHeight(node->right)) + 1;
+    int balance = getBalance(node);
+    if (balance > 1)
+    {
+        if (getBalance(node->left) < 0)
+            node->left = leftRotate(node->left);
+        return rightRotate(node);
+    }
+    if (balance < -1)
+    {
+        if (getBalance(node->right) > 0)
+            node->right = rightRotate(node->right);
+        return leftRotate(node);
+    }
+    return node;
+}
+
+// Joins two trees around a middle node; every title in left sorts before
+// mid and every title in right after it. Cost is O(|height difference|).
+AVLNode *joinTrees(AVLNode *left, AVLNode *mid, AVLNode *right)
+{
+    if (getHeight(left) > getHeight(right) + 1)
+    {
+        left->right = joinTrees(left->right, mid, right);
+        return rebalance(left);
+    }
+    if (getHeight(right) > getHeight(left) + 1)
+    {
+        right->left = joinTrees(left, mid, right->left);
+        return rebalance(right);
+    }
+    mid->left = left;
+    mid->right = right;
+    mid->height = max(getHeight(left), getHeight(right)) + 1;
+    return mid;
+}
+
+AVLNode *removeMin(AVLNode *node, AVLNode *&minNode)
+{
+    if (!node->left)
+    {
+        minNode = node;
+        AVLNode *rest = node->right;
+        node->right = nullptr;
+        node->height = 1;
+        return rest;
+    }
+    node->left = removeMin(node->left, minNode);
+    return rebalance(node);
+}
+
+AVLNode *joinTrees(AVLNode *left, AVLNode *right)
+{
+    if (!left)
+        return right;
+    if (!right)
+        return left;
+    AVLNode *mid;
+    right = removeMin(right, mid);
+    return joinTrees(left, mid, right);
 }
 
-void searchBooks(AVLNode *root, const string &keyword, bool &found)
+// Splits root into titles below key and the rest. With keepEqual set, titles
+// equal to key go to the left tree instead. Titles compare case-insensitively.
+void splitTree(AVLNode *root, const string &key, bool keepEqual, AVLNode *&left, AVLNode *&right)
 {
     if (!root)
+    {
+        left = right = nullptr;
         return;
-    string kw = toLower(keyword);
-    Book &bk = root->book;
-    bool match =
-        toLower(bk.title).find(kw) != string::npos ||
-        toLower(bk.author).find(kw) != string::npos ||
-        toLower(bk.publisher).find(kw) != string::npos ||
-        toLower(bk.month).find(kw) != string::npos ||
-        toLower(bk.day).find(kw) != string::npos ||
-        toLower(bk.year).find(kw) != string::npos ||
-        toLower(bk.isbn).find(kw) != string::npos ||
-        toLower(bk.category).find(kw) != string::npos;
-    if (match)
+    }
+    int cmp = compareTitles(root->book.title, key);
+    AVLNode *l = root->left, *r = root->right;
+    if (cmp < 0 || (keepEqual && cmp == 0))
     {
-        displayBook(bk);
-        found = true;
+        AVLNode *rest;
+        splitTree(r, key, keepEqual, rest, right);
+        left = joinTrees(l, root, rest);
+    }
+    else
+    {
+        AVLNode *rest;
+        splitTree(l, key, keepEqual, left, rest);
+        right = joinTrees(rest, root, r);
+    }
+}
+
+// Detaches every title in [lo, hi] (case-insensitive) as its own balanced tree
+AVLNode *extractRange(AVLNode *&root, const string &lo, const string &hi)
+{
+    if (compareTitles(hi, lo) < 0)
+        return nullptr;
+    AVLNode *before, *rest, *range, *after;
+    splitTree(root, lo, false, before, rest);
+    splitTree(rest, hi, true, range, after);
+    root = joinTrees(before, after);
+    return range;
+}
+
+int eraseRange(AVLNode *&root, const string &lo, const string &hi)
+{
+    return freeTree(extractRange(root, lo, hi));
+}
+
+// Book fields in snapshot and display order
+enum BookField
+{
+    TITLE,
+    AUTHOR,
+    PUBLISHER,
+    MONTH,
+    DAY,
+    YEAR,
+    ISBN,
+    CATEGORY,
+    CALL_NUMBER,
+    FIELD_COUNT
+};
+
+string Book::*const bookFields[FIELD_COUNT] = {
+    &Book::title, &Book::author, &Book::publisher, &Book::month, &Book::day,
+    &Book::year, &Book::isbn, &Book::category, &Book::callNumber};
+
+
+uint32_t crc32(const void *data, size_t size, uint32_t crc = 0)
+{
+    static const array<uint32_t, 256> table = []
+    {
+        array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Snapshot file layout (host byte order, every offset from the file start):
+//   SnapshotHeader | SnapshotRecord[count] | SnapshotNode[count] | string heap
+// Records are sorted by title and node i is the tree node for record i, so a
+// mapped file is searched in place with no parsing or allocation.
+const char SNAPSHOT_MAGIC[8] = {'A', 'V', 'L', 'C', 'A', 'T', '\0', '\0'};
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint32_t SNAPSHOT_NIL = 0xFFFFFFFFu;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t root;
+    uint32_t bodyChecksum; // CRC-32 of everything after the header
+    uint64_t recordOffset;
+    uint64_t nodeOffset;
+    uint64_t heapOffset;
+    uint64_t heapSize;
+    uint32_t keyPolicy;      // KeyPolicy the records are sorted by; 0 in older files
+    uint32_t headerChecksum; // CRC-32 of the header up to this field
+};
+
+struct SnapshotString
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct SnapshotRecord
+{
+    SnapshotString fields[FIELD_COUNT];
+};
+
+struct SnapshotNode
+{
+    uint32_t left;
+    uint32_t right;
+    int32_t height;
+};
+
+// Read-only sorted layer the runtime tree sits on top of
+struct BaseLayer
+{
+    const SnapshotRecord *records;
+    const SnapshotNode *nodes;
+    const char *heap;
+    uint32_t count;
+    uint32_t root;
+    size_t heapSize;
+    KeyPolicy keys = KEY_TITLE;
+};
+
+string_view baseField(const BaseLayer &base, uint32_t record, int field)
+{
+    const SnapshotString &s = base.records[record].fields[field];
+    return string_view(base.heap + s.offset, s.length);
+}
+
+void loadBaseBook(const BaseLayer &base, uint32_t record, Book &out)
+{
+    for (int f = 0; f < FIELD_COUNT; f++)
+    {
+        string_view value = baseField(base, record, f);
+        (out.*bookFields[f]).assign(value.data(), value.size());
+    }
+}
+
+// The record keyed (title, isbn), or with isbn null one titled title
+uint32_t baseFind(const BaseLayer &base, string_view title, const string *isbn = nullptr)
+{
+    uint32_t i = base.root;
+    while (i != SNAPSHOT_NIL)
+    {
+        COUNT(NODES_VISITED, 1);
+        COUNT(COMPARISONS, 1);
+        int cmp = isbn ? compareKeys(title, *isbn, baseField(base, i, TITLE), baseField(base, i, ISBN), KEY_TITLE_ISBN)
+                       : compareTitles(title, baseField(base, i, TITLE));
+        if (cmp == 0)
+            return i;
+        i = cmp < 0 ? base.nodes[i].left : base.nodes[i].right;
+    }
+    return SNAPSHOT_NIL;
+}
+
+// First record whose title is >= key, or > key when after is set
+uint32_t baseBound(const BaseLayer &base, string_view key, bool after)
+{
+    uint32_t i = base.root, bound = base.count;
+    while (i != SNAPSHOT_NIL)
+    {
+        int cmp = compareTitles(baseField(base, i, TITLE), key);
+        if (cmp > 0 || (cmp == 0 && !after))
+        {
+            bound = i;
+            i = base.nodes[i].left;
+        }
+        else
+            i = base.nodes[i].right;
+    }
+    return bound;
+}
+
+struct Snapshot
+{
+    void *map = nullptr;
+    size_t size = 0;
+    BaseLayer layer = {};
+};
+
+void closeSnapshot(Snapshot &snap)
+{
+    if (snap.map)
+        munmap(snap.map, snap.size);
+    snap = Snapshot();
+}
+
+// Whether every string in the records lies inside the heap and the tree
+// reachable from the root is a search tree over the record indexes (as
+// buildSnapshotNodes lays it out), so lookups stay inside the mapping and
+// cannot loop. Reads the record and node arrays once but not the string heap.
+bool snapshotInBounds(const SnapshotHeader &h, const SnapshotRecord *records, const SnapshotNode *nodes)
+{
+    for (uint32_t i = 0; i < h.count; i++)
+        for (const SnapshotString &field : records[i].fields)
+            if ((uint64_t)field.offset + field.length > h.heapSize)
+                return false;
+    // Each node must fall inside the index range its parent leaves it
+    struct Span
+    {
+        uint32_t node, lo, hi;
+    };
+    vector<Span> stack;
+    if (h.root != SNAPSHOT_NIL)
+        stack.push_back({h.root, 0, h.count});
+    while (!stack.empty())
+    {
+        Span span = stack.back();
+        stack.pop_back();
+        if (span.node < span.lo || span.node >= span.hi)
+            return false;
+        const SnapshotNode &node = nodes[span.node];
+        if (node.left != SNAPSHOT_NIL)
+            stack.push_back({node.left, span.lo, span.node});
+        if (node.right != SNAPSHOT_NIL)
+            stack.push_back({node.right, span.node + 1, span.hi});
+    }
+    return true;
+}
+
+// Maps a snapshot read-only. The header, the array extents and their
+// alignment are checked, which costs nothing per record; verify also
+// checksums the body and checks every string and node index (a full read of
+// the file), for snapshots that may be damaged.
+bool openSnapshot(const string &path, Snapshot &snap, bool verify)
+{
+    TRACE_SPAN("open snapshot");
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        cout << "Error: cannot open " << path << "." << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        cout << "Error: " << path << " is not a catalog snapshot." << endl;
+        return false;
+    }
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        cout << "Error: cannot map " << path << "." << endl;
+        return false;
+    }
+    const char *base = (const char *)map;
+    const SnapshotHeader &h = *(const SnapshotHeader *)base;
+    bool valid =
+        memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) == 0 &&
+        h.headerChecksum == crc32(&h, offsetof(SnapshotHeader, headerChecksum)) &&
+        h.version == SNAPSHOT_VERSION &&
+        h.recordOffset <= size && h.nodeOffset <= size && h.heapOffset <= size &&
+        h.recordOffset % alignof(SnapshotRecord) == 0 && h.nodeOffset % alignof(SnapshotNode) == 0 &&
+        h.recordOffset + (uint64_t)h.count * sizeof(SnapshotRecord) <= size &&
+        h.nodeOffset + (uint64_t)h.count * sizeof(SnapshotNode) <= size &&
+        h.heapSize <= size - h.heapOffset && h.keyPolicy <= KEY_TITLE_ISBN &&
+        (h.root < h.count || (h.count == 0 && h.root == SNAPSHOT_NIL));
+    if (valid && verify)
+        valid = h.bodyChecksum == crc32(base + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)) &&
+                snapshotInBounds(h, (const SnapshotRecord *)(base + h.recordOffset),
+                                 (const SnapshotNode *)(base + h.nodeOffset));
+    if (!valid)
+    {
+        munmap(map, size);
+        cout << "Error: " << path << " is corrupt or from an unsupported version." << endl;
+        return false;
+    }
+    snap.map = map;
+    snap.size = size;
+    snap.layer.records = (const SnapshotRecord *)(base + h.recordOffset);
+    snap.layer.nodes = (const SnapshotNode *)(base + h.nodeOffset);
+    snap.layer.heap = base + h.heapOffset;
+    snap.layer.count = h.count;
+    snap.layer.root = h.root;
+    snap.layer.heapSize = h.heapSize;
+    snap.layer.keys = (KeyPolicy)h.keyPolicy;
+    return true;
+}
+
+// The catalog: a read-only base layer (snapshot) plus the runtime AVL tree
+// holding every book added since it was loaded. Removed base records are
+// tombstoned rather than copied out.
+struct CatalogIndex;
+struct CompletionIndex;
+struct QueryCache;
+
+struct Catalog
+{
+    AVLNode *root = nullptr;
+    const BaseLayer *base = nullptr;
+    vector<bool> removed;
+    CatalogIndex *index = nullptr;          // query indexes, built on demand
+    CompletionIndex *completions = nullptr; // autocomplete, built on demand
+    QueryCache *queries = nullptr;          // cached query results, made on demand
+    uint64_t version = 0;                   // bumped by every change to the books
+    KeyPolicy keys = KEY_TITLE;             // the base layer must be sorted by it too
+};
+
+// The ISBN part of book's key, or null when titles alone are keys
+const string *bookKey(const Catalog &cat, const Book &book)
+{
+    return cat.keys == KEY_TITLE_ISBN ? &book.isbn : nullptr;
+}
+
+// Query cache upkeep, defined with the query language
+void invalidateQueries(Catalog &cat, const Book &book);
+void invalidateQueryRange(Catalog &cat, const string &lo, const string &hi);
+void invalidateQueries(Catalog &cat, const vector<const Book *> &books);
+void dropQueries(Catalog &cat);
+
+bool baseLive(const Catalog &cat, uint32_t record)
+{
+    return record < cat.removed.size() ? !cat.removed[record] : true;
+}
+
+void removeBase(Catalog &cat, uint32_t record)
+{
+    if (cat.removed.size() < cat.base->count)
+        cat.removed.resize(cat.base->count);
+    cat.removed[record] = true;
+}
+
+// Secondary indexes for the query language, built on the first query and
+// then kept up to date by catalogAdd and catalogRemove. Bulk changes
+// (import, range removal) drop them to be rebuilt on the next query. Every
+// live book has a doc id: base records use their record number and runtime
+// books get baseCount + n in insertion order, so posting lists stay sorted.
+// Postings are not shrunk on removal; the live bitmap filters stale entries
+// and the indexes are rebuilt once stale entries outnumber live books.
+// Ranked-search postings: tf is the term's boosted frequency in the doc
+// (each title occurrence counts TITLE_BOOST, and so on). maxTf and
+// minLength bound every BM25 contribution the term can make, for WAND;
+// each block of TEXT_BLOCK postings keeps the same bounds for itself.
+struct TextPosting
+{
+    uint32_t doc;
+    float tf;
+};
+
+struct TextBlock
+{
+    uint32_t last; // doc of the block's last posting
+    float maxTf, minLength;
+};
+
+const size_t TEXT_BLOCK = 64;
+
+struct TextTerm
+{
+    vector<TextPosting> postings;
+    vector<TextBlock> blocks;
+    float maxTf = 0, minLength = 1e30f;
+};
+
+const float TITLE_BOOST = 3, AUTHOR_BOOST = 2, CATEGORY_BOOST = 1;
+
+// textTerms entries in key order for fuzzy lookup. The keys are copied out
+// back to back (term i is text from start[i] to start[i + 1]) next to the
+// bytes each shares with the term before it, capped at 255, so a walk over
+// the dictionary never leaves these arrays.
+struct TermDictionary
+{
+    vector<const pair<const string, TextTerm> *> entries;
+    string text;
+    vector<uint32_t> start;
+    vector<uint8_t> shared;
+};
+
+struct CatalogIndex
+{
+    uint32_t baseCount = 0;
+    vector<AVLNode *> overlayDocs; // doc - baseCount -> node, null once removed
+    vector<uint64_t> live;         // bitmap of live docs
+    size_t liveCount = 0, staleEntries = 0;
+    unordered_map<string, vector<uint32_t>> authorWords;  // folded author word -> docs
+    unordered_map<string, vector<uint64_t>> categories;   // folded category -> bitmap
+    unordered_map<string, size_t> categoryCounts;
+    map<int, vector<uint32_t>> years;                     // publication year -> docs
+    vector<string> titleSample; // every titleStep-th title, in order, at build time
+    size_t titleStep = 1;
+    unordered_map<string, TextTerm> textTerms; // folded word of title, author or category
+    vector<float> docLength;                   // boosted word count per doc
+    double totalLength = 0;                    // over live docs
+    // Fuzzy lookup dictionaries, built on the first lookup. Terms created
+    // after that collect in newTerms and get a small dictionary of their own
+    // until there are too many, when everything is merged into the big one.
+    TermDictionary terms, recentTerms;
+    vector<const pair<const string, TextTerm> *> newTerms;
+};
+
+inline bool testBit(const vector<uint64_t> &bits, uint32_t i)
+{
+    return i / 64 < bits.size() && (bits[i / 64] >> (i % 64) & 1);
+}
+
+inline void setBit(vector<uint64_t> &bits, uint32_t i, bool value)
+{
+    if (i / 64 >= bits.size())
+        bits.resize(i / 64 + 1);
+    if (value)
+        bits[i / 64] |= 1ull << (i % 64);
+    else
+        bits[i / 64] &= ~(1ull << (i % 64));
+}
+
+// Appends the lower-cased words of text (runs of letters, digits and
+// non-ASCII bytes) to words
+void foldWords(string_view text, vector<string> &words)
+{
+    size_t i = 0;
+    while (i < text.size())
+    {
+        auto isWord = [&](size_t k) { return isalnum((unsigned char)text[k]) || (unsigned char)text[k] >= 0x80; };
+        while (i < text.size() && !isWord(i))
+            i++;
+        size_t start = i;
+        while (i < text.size() && isWord(i))
+            i++;
+        if (i > start)
+        {
+            words.emplace_back(text.substr(start, i - start));
+            for (char &c : words.back())
+                c = tolower(c);
+        }
+    }
+}
+
+void indexDoc(CatalogIndex &index, uint32_t doc, const Book &book)
+{
+    setBit(index.live, doc, true);
+    index.liveCount++;
+    vector<string> words;
+    foldWords(book.author, words);
+    sort(words.begin(), words.end());
+    words.erase(unique(words.begin(), words.end()), words.end());
+    for (string &word : words)
+        index.authorWords[word].push_back(doc);
+    string category = toLower(book.category);
+    setBit(index.categories[category], doc, true);
+    index.categoryCounts[category]++;
+    index.years[atoi(book.year.c_str())].push_back(doc);
+
+    vector<pair<string, float>> occurrences;
+    float length = 0;
+    for (auto field : {make_pair(&book.title, TITLE_BOOST), make_pair(&book.author, AUTHOR_BOOST),
+                       make_pair(&book.category, CATEGORY_BOOST)})
+    {
+        words.clear();
+        foldWords(*field.first, words);
+        for (string &word : words)
+            occurrences.emplace_back(std::move(word), field.second);
+        length += field.second * words.size();
+    }
+    sort(occurrences.begin(), occurrences.end());
+    for (size_t i = 0; i < occurrences.size();)
+    {
+        float tf = 0;
+        size_t j = i;
+        for (; j < occurrences.size() && occurrences[j].first == occurrences[i].first; j++)
+            tf += occurrences[j].second;
+        auto entry = index.textTerms.try_emplace(occurrences[i].first);
+        if (entry.second)
+            index.newTerms.push_back(&*entry.first);
+        TextTerm &term = entry.first->second;
+        if (term.postings.size() % TEXT_BLOCK == 0)
+            term.blocks.push_back({doc, tf, length});
+        term.postings.push_back({doc, tf});
+        TextBlock &block = term.blocks.back();
+        block.last = doc;
+        block.maxTf = max(block.maxTf, tf);
+        block.minLength = min(block.minLength, length);
+        term.maxTf = max(term.maxTf, tf);
+        term.minLength = min(term.minLength, length);
+        i = j;
+    }
+    if (index.docLength.size() <= doc)
+        index.docLength.resize(doc + 1);
+    index.docLength[doc] = length;
+    index.totalLength += length;
+}
+
+void unindexDoc(CatalogIndex &index, uint32_t doc, const Book &book)
+{
+    setBit(index.live, doc, false);
+    index.liveCount--;
+    string category = toLower(book.category);
+    setBit(index.categories[category], doc, false);
+    index.categoryCounts[category]--;
+    vector<string> words;
+    foldWords(book.author, words);
+    foldWords(book.title, words);
+    foldWords(book.category, words);
+    index.staleEntries += words.size() + 1;
+    index.totalLength -= index.docLength[doc];
+}
+
+void dropIndex(Catalog &cat)
+{
+    delete cat.index;
+    cat.index = nullptr;
+}
+
+// The book behind doc; base books are loaded into scratch
+const Book &docBook(const Catalog &cat, uint32_t doc, Book &scratch)
+{
+    if (doc >= cat.index->baseCount)
+        return cat.index->overlayDocs[doc - cat.index->baseCount]->book;
+    loadBaseBook(*cat.base, doc, scratch);
+    return scratch;
+}
+
+void indexNode(CatalogIndex &index, AVLNode *node)
+{
+    node->doc = index.baseCount + index.overlayDocs.size();
+    index.overlayDocs.push_back(node);
+    indexDoc(index, node->doc, node->book);
+}
+
+// Runtime-tree node keyed (title, isbn), or with isbn null one titled title
+AVLNode *overlayFind(AVLNode *node, string_view title, const string *isbn = nullptr)
+{
+    while (node)
+    {
+        COUNT(NODES_VISITED, 1);
+        COUNT(COMPARISONS, 1);
+        int cmp = compareKey(title, isbn, node->book);
+        if (cmp == 0)
+            return node;
+        node = cmp < 0 ? node->left : node->right;
+    }
+    return nullptr;
+}
+
+// Autocomplete. Titles complete straight from the title tree's prefix range;
+// authors come from a radix tree over folded names, keyed from every word
+// so "kish" finds "Noam Kishimoto". Each node keeps the best COMPLETION_TOP
+// authors below it, most books first, so a keystroke costs a walk down the
+// typed prefix and a read of one list. Built on the first completion and
+// kept up to date by catalogAdd and catalogRemove; bulk changes drop it.
+const size_t COMPLETION_TOP = 16;
+
+struct AuthorEntry
+{
+    string name;   // as first seen
+    string folded;
+    uint32_t books = 0;
+    vector<uint32_t> nodes; // where each of its keys ends
+};
+
+struct CompletionNode
+{
+    string label; // folded bytes on the edge from the parent
+    uint32_t parent = 0;
+    vector<uint32_t> children; // by first label byte
+    string firsts;             // first label byte of each child, in the same order
+    vector<uint32_t> authors;  // entries with a key ending here
+    vector<uint32_t> top;      // best authors in the subtree, most books first
+};
+
+struct CompletionIndex
+{
+    vector<CompletionNode> nodes = vector<CompletionNode>(1); // nodes[0] is the root
+    vector<AuthorEntry> authors; // kept at zero books once removed
+    unordered_map<string, uint32_t> authorIds; // folded name -> entry
+};
+
+string foldKey(string_view text)
+{
+    string key(text);
+    for (char &c : key)
+        c = foldTable[(unsigned char)c];
+    return key;
+}
+
+// Completion order: most books first, then folded name
+bool authorBefore(const CompletionIndex &ci, uint32_t a, uint32_t b)
+{
+    if (ci.authors[a].books != ci.authors[b].books)
+        return ci.authors[a].books > ci.authors[b].books;
+    return ci.authors[a].folded < ci.authors[b].folded;
+}
+
+// Child of node whose label starts with c, or 0
+uint32_t completionChild(const CompletionIndex &ci, uint32_t node, char c)
+{
+    size_t at = ci.nodes[node].firsts.find(c);
+    return at == string::npos ? 0 : ci.nodes[node].children[at];
+}
+
+// The node where key ends, splitting an edge or adding a leaf as needed
+uint32_t completionNode(CompletionIndex &ci, string_view key)
+{
+    uint32_t node = 0;
+    for (size_t at = 0; at < key.size();)
+    {
+        uint32_t child = completionChild(ci, node, key[at]);
+        if (!child)
+        {
+            child = ci.nodes.size();
+            ci.nodes.emplace_back();
+            ci.nodes[child].label = key.substr(at);
+            ci.nodes[child].parent = node;
+            string &firsts = ci.nodes[node].firsts;
+            size_t slot = upper_bound(firsts.begin(), firsts.end(), key[at],
+                                      [](char a, char b) { return (unsigned char)a < (unsigned char)b; }) -
+                          firsts.begin();
+            firsts.insert(firsts.begin() + slot, key[at]);
+            ci.nodes[node].children.insert(ci.nodes[node].children.begin() + slot, child);
+            return child;
+        }
+        const string &label = ci.nodes[child].label;
+        size_t common = 1;
+        while (common < label.size() && at + common < key.size() && label[common] == key[at + common])
+            common++;
+        if (common < label.size())
+        {
+            // Split the edge: a new node takes the shared part and child's place
+            uint32_t middle = ci.nodes.size();
+            ci.nodes.emplace_back();
+            CompletionNode &split = ci.nodes[middle];
+            split.label = ci.nodes[child].label.substr(0, common);
+            split.parent = node;
+            split.children = {child};
+            split.firsts = ci.nodes[child].label.substr(common, 1);
+            split.top = ci.nodes[child].top;
+            ci.nodes[child].label.erase(0, common);
+            ci.nodes[child].parent = middle;
+            replace(ci.nodes[node].children.begin(), ci.nodes[node].children.end(), child, middle);
+            child = middle;
+        }
+        node = child;
+        at += common;
+    }
+    return node;
+}
+
+// Recomputes node's top list from its own authors and its children's lists
+void refillTop(CompletionIndex &ci, uint32_t node)
+{
+    vector<uint32_t> candidates;
+    for (uint32_t id : ci.nodes[node].authors)
+        candidates.push_back(id);
+    for (uint32_t child : ci.nodes[node].children)
+        candidates.insert(candidates.end(), ci.nodes[child].top.begin(), ci.nodes[child].top.end());
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+    candidates.erase(remove_if(candidates.begin(), candidates.end(), [&](uint32_t id) { return !ci.authors[id].books; }),
+                     candidates.end());
+    size_t keep = min(candidates.size(), COMPLETION_TOP);
+    partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(),
+                 [&](uint32_t a, uint32_t b) { return authorBefore(ci, a, b); });
+    candidates.resize(keep);
+    ci.nodes[node].top = std::move(candidates);
+}
+
+// Entry for author, creating it and its keys on first sight
+uint32_t authorEntry(CompletionIndex &ci, const string &author)
+{
+    string folded = foldKey(author);
+    auto found = ci.authorIds.try_emplace(folded, ci.authors.size());
+    uint32_t id = found.first->second;
+    if (!found.second)
+        return id;
+    ci.authors.push_back({author, folded, 0, {}});
+    for (size_t at = 0; at < folded.size(); at++)
+        if (isalnum((unsigned char)folded[at]) && (at == 0 || !isalnum((unsigned char)folded[at - 1])))
+        {
+            uint32_t node = completionNode(ci, string_view(folded).substr(at));
+            ci.nodes[node].authors.push_back(id);
+            ci.authors[id].nodes.push_back(node);
+        }
+    return id;
+}
+
+// Counts one more book by author, moving it up the lists on its key paths
+void addAuthorBook(CompletionIndex &ci, const string &author)
+{
+    uint32_t id = authorEntry(ci, author);
+    ci.authors[id].books++;
+    for (uint32_t key : ci.authors[id].nodes)
+        for (uint32_t node = key;; node = ci.nodes[node].parent)
+        {
+            vector<uint32_t> &top = ci.nodes[node].top;
+            auto at = find(top.begin(), top.end(), id);
+            if (at != top.end())
+                top.erase(at);
+            top.insert(lower_bound(top.begin(), top.end(), id,
+                                   [&](uint32_t a, uint32_t b) { return authorBefore(ci, a, b); }),
+                       id);
+            if (top.size() > COMPLETION_TOP)
+                top.pop_back();
+            if (node == 0)
+                break;
+        }
+}
+
+// Counts one book fewer; lists that held the author are refilled bottom-up
+void removeAuthorBook(CompletionIndex &ci, const string &author)
+{
+    auto found = ci.authorIds.find(foldKey(author));
+    if (found == ci.authorIds.end() || !ci.authors[found->second].books)
+        return;
+    uint32_t id = found->second;
+    ci.authors[id].books--;
+    for (uint32_t key : ci.authors[id].nodes)
+        for (uint32_t node = key;; node = ci.nodes[node].parent)
+        {
+            // A list without the author is not affected, nor are the ones above it
+            const vector<uint32_t> &top = ci.nodes[node].top;
+            if (find(top.begin(), top.end(), id) == top.end())
+                break;
+            refillTop(ci, node);
+            if (node == 0)
+                break;
+        }
+}
+
+void dropCompletions(Catalog &cat)
+{
+    delete cat.completions;
+    cat.completions = nullptr;
+}
+
+template <typename Visit>
+void catalogEqualRange(const Catalog &cat, const string &title, Visit visit);
+
+// Looks title up and hands the live book to found; returns whether it exists.
+// In a KEY_TITLE_ISBN catalog isbn picks the edition, and without it the
+// first edition in ISBN order is found; other catalogs ignore isbn.
+template <typename Found>
+bool catalogLookup(const Catalog &cat, const string &title, Found found, const string *isbn = nullptr)
+{
+    COUNT_TIME(LOOKUP_NS);
+    string edition; // the traced argument when an edition is named
+    if (isbn)
+        edition = *isbn + '\t' + title;
+    LatencyTimer timer(OP_FIND, isbn ? &edition : &title);
+    TRACE_SPAN("find");
+    if (cat.keys == KEY_TITLE_ISBN && !isbn)
+    {
+        // a base record with this title may be tombstoned while an edition
+        // next to it is live, so walk the editions in order
+        bool any = false;
+        catalogEqualRange(cat, title, [&](const Book &book) {
+            found(book);
+            any = true;
+            return false;
+        });
+        return any;
+    }
+    if (cat.keys == KEY_TITLE)
+        isbn = nullptr;
+    if (AVLNode *node = overlayFind(cat.root, title, isbn))
+    {
+        found(node->book);
+        return true;
+    }
+    if (!cat.base)
+        return false;
+    uint32_t record = baseFind(*cat.base, title, isbn);
+    if (record == SNAPSHOT_NIL || !baseLive(cat, record))
+        return false;
+    Book book;
+    loadBaseBook(*cat.base, record, book);
+    found(book);
+    return true;
+}
+
+bool catalogContains(const Catalog &cat, const string &title, const string *isbn = nullptr)
+{
+    return catalogLookup(cat, title, [](const Book &) {}, isbn);
+}
+
+// Returns false when a book with the same key is already in the catalog
+bool catalogAdd(Catalog &cat, const Book &book)
+{
+    COUNT_TIME(INSERT_NS);
+    LatencyTimer timer(OP_ADD, &book);
+    TRACE_SPAN("add");
+    const string *isbn = bookKey(cat, book);
+    if (cat.base)
+    {
+        TRACE_SPAN("base lookup");
+        uint32_t record = baseFind(*cat.base, book.title, isbn);
+        if (record != SNAPSHOT_NIL && baseLive(cat, record))
+            return false; // duplicate keys are dropped, as in insert
+    }
+    TRACE_SPAN("descent");
+    if (overlayFind(cat.root, book.title, isbn))
+        return false;
+    cat.root = insert(cat.root, book, cat.keys);
+    cat.version++;
+    invalidateQueries(cat, book);
+    if (cat.index)
+    {
+        TRACE_SPAN("index maintenance");
+        indexNode(*cat.index, overlayFind(cat.root, book.title, isbn));
+    }
+    if (cat.completions)
+        addAuthorBook(*cat.completions, book.author);
+    return true;
+}
+
+// Drops the query indexes once most of their postings are stale
+void compactIndex(Catalog &cat)
+{
+    if (cat.index && cat.index->staleEntries > 2 * cat.index->liveCount + 1024)
+        dropIndex(cat);
+}
+
+// Removes the book keyed (title, isbn), or titled title when isbn is null,
+// from both layers; the caller bumps the version
+bool removeKey(Catalog &cat, const string &title, const string *isbn)
+{
+    bool removed = false;
+    {
+        TRACE_SPAN("descent");
+        if (AVLNode *node = overlayFind(cat.root, title, isbn))
+        {
+            invalidateQueries(cat, node->book);
+            if (cat.index)
+            {
+                unindexDoc(*cat.index, node->doc, node->book);
+                cat.index->overlayDocs[node->doc - cat.index->baseCount] = nullptr;
+            }
+            if (cat.completions)
+                removeAuthorBook(*cat.completions, node->book.author);
+            cat.root = deleteNode(cat.root, title, isbn);
+            removed = true;
+        }
+    }
+    if (cat.base)
+    {
+        TRACE_SPAN("tombstone");
+        uint32_t record = baseFind(*cat.base, title, isbn);
+        if (record != SNAPSHOT_NIL && baseLive(cat, record))
+        {
+            if (cat.index || cat.queries)
+            {
+                Book book;
+                loadBaseBook(*cat.base, record, book);
+                invalidateQueries(cat, book);
+                if (cat.index)
+                    unindexDoc(*cat.index, record, book);
+            }
+            if (cat.completions)
+                removeAuthorBook(*cat.completions, string(baseField(*cat.base, record, AUTHOR)));
+            removeBase(cat, record);
+            removed = true;
+        }
+    }
+    return removed;
+}
+
+// Returns false when the title was not in the catalog. In a KEY_TITLE_ISBN
+// catalog isbn picks the edition to remove, and without it every edition goes.
+bool catalogRemove(Catalog &cat, const string &title, const string *isbn = nullptr)
+{
+    COUNT_TIME(DELETE_NS);
+    string edition; // the traced argument when an edition is named
+    if (isbn)
+        edition = *isbn + '\t' + title;
+    LatencyTimer timer(OP_REMOVE, isbn ? &edition : &title);
+    TRACE_SPAN("remove");
+    bool removed = false;
+    if (cat.keys == KEY_TITLE)
+        removed = removeKey(cat, title, nullptr);
+    else if (isbn)
+        removed = removeKey(cat, title, isbn);
+    else
+    {
+        vector<string> editions;
+        catalogEqualRange(cat, title, [&](const Book &book) { editions.push_back(book.isbn); });
+        for (const string &edition : editions)
+            removed |= removeKey(cat, title, &edition);
+    }
+    if (removed)
+        cat.version++;
+    compactIndex(cat);
+    return removed;
+}
+
+int catalogEraseRange(Catalog &cat, const string &lo, const string &hi)
+{
+    TRACE_SPAN("erase range");
+    dropIndex(cat);
+    dropCompletions(cat);
+    invalidateQueryRange(cat, lo, hi);
+    cat.version++;
+    int removed = eraseRange(cat.root, lo, hi);
+    if (!cat.base || compareTitles(hi, lo) < 0)
+        return removed;
+    uint32_t end = baseBound(*cat.base, hi, true);
+    for (uint32_t i = baseBound(*cat.base, lo, false); i < end; i++)
+        if (baseLive(cat, i))
+        {
+            removeBase(cat, i);
+            removed++;
+        }
+    return removed;
+}
+
+// Where a live book sits, without copying it: its runtime-tree node, or
+// its base record when node is null. Valid until the catalog next changes.
+struct BookRef
+{
+    const AVLNode *node;
+    uint32_t record;
+};
+
+const Book &refBook(const Catalog &cat, BookRef ref, Book &scratch)
+{
+    if (ref.node)
+        return ref.node->book;
+    loadBaseBook(*cat.base, ref.record, scratch);
+    return scratch;
+}
+
+// Hands book to a visitor taking (book) or (book, ref); false means stop,
+// which only a visitor returning bool can ask for
+template <typename Visit>
+bool visitBook(Visit &visit, const Book &book, BookRef ref)
+{
+    if constexpr (is_invocable_v<Visit &, const Book &, BookRef>)
+    {
+        if constexpr (is_same_v<invoke_result_t<Visit &, const Book &, BookRef>, bool>)
+            return visit(book, ref);
+        visit(book, ref);
+    }
+    else
+    {
+        if constexpr (is_same_v<invoke_result_t<Visit &, const Book &>, bool>)
+            return visit(book);
+        visit(book);
+    }
+    return true;
+}
+
+// Visits every live book with lo <= title < hi in title order (a null bound
+// is open), merging the runtime tree with the base layer. Base books are
+// handed out through one reused scratch Book. Visitors may also take the
+// BookRef, and one that returns bool stops the scan by returning false.
+template <typename Visit>
+void catalogScan(const Catalog &cat, const string *lo, const string *hi, Visit visit)
+{
+    vector<AVLNode *> stack;
+    for (AVLNode *n = cat.root; n;)
+        if (!lo || compareTitles(n->book.title, *lo) >= 0)
+        {
+            stack.push_back(n);
+            n = n->left;
+        }
+        else
+            n = n->right;
+    uint32_t count = cat.base ? cat.base->count : 0;
+    uint32_t next = cat.base && lo ? baseBound(*cat.base, *lo, false) : 0;
+    if (cat.base && hi)
+        count = baseBound(*cat.base, *hi, false);
+    Book scratch;
+    while (!stack.empty() || next < count)
+    {
+        if (next < count && !baseLive(cat, next))
+        {
+            next++;
+            continue;
+        }
+        if (next < count && (stack.empty() || compareKeys(baseField(*cat.base, next, TITLE), baseField(*cat.base, next, ISBN),
+                                                          stack.back()->book.title, stack.back()->book.isbn, cat.keys) < 0))
+        {
+            loadBaseBook(*cat.base, next, scratch);
+            if (!visitBook(visit, scratch, {nullptr, next++}))
+                return;
+            continue;
+        }
+        AVLNode *node = stack.back();
+        stack.pop_back();
+        if (hi && compareTitles(node->book.title, *hi) >= 0)
+        {
+            stack.clear();
+            continue;
+        }
+        if (!visitBook(visit, node->book, {node, 0}))
+            return;
+        for (AVLNode *n = node->right; n; n = n->left)
+            stack.push_back(n);
+    }
+}
+
+template <typename Visit>
+void catalogForEach(const Catalog &cat, Visit visit)
+{
+    catalogScan(cat, nullptr, nullptr, visit);
+}
+
+// Visits every live book titled title (case-insensitive) in key order: at
+// most one in a KEY_TITLE catalog, each edition in a KEY_TITLE_ISBN one.
+// Costs O(log n + k) for k editions.
+template <typename Visit>
+void catalogEqualRange(const Catalog &cat, const string &title, Visit visit)
+{
+    string end = title + '\0'; // the first title after every spelling of title
+    catalogScan(cat, &title, &end, visit);
+}
+
+// Upper bound of the title range that starts with prefix
+string prefixEnd(const string &prefix)
+{
+    return prefix + '\xff';
+}
+
+// Visits every book whose title starts with prefix (case-insensitive)
+template <typename Visit>
+void catalogPrefix(const Catalog &cat, const string &prefix, Visit visit)
+{
+    LatencyTimer timer(OP_PREFIX, &prefix);
+    TRACE_SPAN("prefix search");
+    string end = prefixEnd(prefix);
+    catalogScan(cat, &prefix, &end, visit);
+}
+
+// Balanced node array over sorted records [lo, hi); returns the subtree root
+uint32_t buildSnapshotNodes(vector<SnapshotNode> &nodes, uint32_t lo, uint32_t hi)
+{
+    if (lo >= hi)
+        return SNAPSHOT_NIL;
+    uint32_t mid = lo + (hi - lo) / 2;
+    uint32_t left = buildSnapshotNodes(nodes, lo, mid);
+    uint32_t right = buildSnapshotNodes(nodes, mid + 1, hi);
+    int32_t lh = left == SNAPSHOT_NIL ? 0 : nodes[left].height;
+    int32_t rh = right == SNAPSHOT_NIL ? 0 : nodes[right].height;
+    nodes[mid] = {left, right, max(lh, rh) + 1};
+    return mid;
+}
+
+// Writes the whole catalog to path through a temporary file and a rename, so
+// a snapshot that is currently mapped stays intact until the rename.
+bool saveSnapshot(const Catalog &cat, const string &path)
+{
+    TRACE_SPAN("save snapshot");
+    vector<SnapshotRecord> records;
+    string heap;
+    unordered_map<string, uint32_t> interned; // authors, publishers, months... repeat a lot
+    bool overflow = false;
+    catalogForEach(cat, [&](const Book &book) {
+        SnapshotRecord record;
+        for (int f = 0; f < FIELD_COUNT; f++)
+        {
+            const string &value = book.*bookFields[f];
+            auto it = interned.find(value);
+            if (it == interned.end())
+            {
+                if (heap.size() + value.size() > SNAPSHOT_NIL)
+                    overflow = true;
+                it = interned.emplace(value, (uint32_t)heap.size()).first;
+                heap += value;
+            }
+            record.fields[f] = {it->second, (uint32_t)value.size()};
+        }
+        records.push_back(record);
+    });
+    if (overflow || records.size() >= SNAPSHOT_NIL)
+    {
+        cout << "Error: catalog is too large for the snapshot format." << endl;
+        return false;
+    }
+    vector<SnapshotNode> nodes(records.size());
+    uint32_t root = buildSnapshotNodes(nodes, 0, records.size());
+
+    SnapshotHeader h = {};
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.count = records.size();
+    h.root = root;
+    h.recordOffset = sizeof(SnapshotHeader);
+    h.nodeOffset = h.recordOffset + records.size() * sizeof(SnapshotRecord);
+    h.heapOffset = h.nodeOffset + nodes.size() * sizeof(SnapshotNode);
+    h.heapSize = heap.size();
+    h.keyPolicy = cat.keys;
+    uint32_t crc = crc32(records.data(), records.size() * sizeof(SnapshotRecord));
+    crc = crc32(nodes.data(), nodes.size() * sizeof(SnapshotNode), crc);
+    h.bodyChecksum = crc32(heap.data(), heap.size(), crc);
+    h.headerChecksum = crc32(&h, offsetof(SnapshotHeader, headerChecksum));
+
+    string temp = path + ".tmp";
+    ofstream out(temp, ios::binary | ios::trunc);
+    out.write((const char *)&h, sizeof(h));
+    out.write((const char *)records.data(), records.size() * sizeof(SnapshotRecord));
+    out.write((const char *)nodes.data(), nodes.size() * sizeof(SnapshotNode));
+    out.write(heap.data(), heap.size());
+    out.close();
+    if (!out || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        cout << "Error: could not write " << path << "." << endl;
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Relinks nodes[lo, hi) (already in title order) into a balanced subtree
+AVLNode *linkBalanced(vector<AVLNode *> &nodes, size_t lo, size_t hi)
+{
+    if (lo >= hi)
+        return nullptr;
+    size_t mid = lo + (hi - lo) / 2;
+    AVLNode *node = nodes[mid];
+    node->left = linkBalanced(nodes, lo, mid);
+    node->right = linkBalanced(nodes, mid + 1, hi);
+    node->height = max(getHeight(node->left), getHeight(node->right)) + 1;
+    return node;
+}
+
+void collectNodes(AVLNode *node, vector<AVLNode *> &nodes)
+{
+    if (!node)
+        return;
+    collectNodes(node->left, nodes);
+    nodes.push_back(node);
+    collectNodes(node->right, nodes);
+}
+
+// Adds books sorted by key (stable, so the first of equal keys wins) in
+// O(n + m): the runtime tree is merged with the new books and relinked into
+// a balanced tree without a single rotation. Keys already in the catalog
+// are dropped, as with insert.
+int bulkLoad(Catalog &cat, vector<Book> &sorted)
+{
+    TRACE_SPAN("bulk load");
+    dropIndex(cat);
+    dropCompletions(cat);
+    cat.version++;
+    vector<AVLNode *> existing, merged;
+    collectNodes(cat.root, existing);
+    merged.reserve(existing.size() + sorted.size());
+    vector<const Book *> fresh; // for the query cache
+    size_t e = 0;
+    int added = 0;
+    auto order = [&](const Book &a, const Book &b) { return compareKeys(a.title, a.isbn, b.title, b.isbn, cat.keys); };
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        Book &book = sorted[i];
+        while (e < existing.size() && order(existing[e]->book, book) < 0)
+            merged.push_back(existing[e++]);
+        // the earlier of equal new books has been moved into merged already
+        if ((e < existing.size() && order(existing[e]->book, book) == 0) ||
+            (!merged.empty() && order(merged.back()->book, book) == 0))
+            continue;
+        if (cat.base)
+        {
+            uint32_t record = baseFind(*cat.base, book.title, bookKey(cat, book));
+            if (record != SNAPSHOT_NIL && baseLive(cat, record))
+                continue;
+        }
+        merged.push_back(new AVLNode{std::move(book), nullptr, nullptr, 1});
+        if (cat.queries)
+            fresh.push_back(&merged.back()->book);
+        added++;
+    }
+    while (e < existing.size())
+        merged.push_back(existing[e++]);
+    cat.root = linkBalanced(merged, 0, merged.size());
+    invalidateQueries(cat, fresh);
+    return added;
+}
+
+// Parses one CSV (RFC 4180 quoting) or TSV record at p straight into book.
+// Unquoted fields are assigned from the input buffer with no temporaries.
+// Returns the start of the next record; fields gets the number of fields seen.
+const char *parseRecord(const char *p, const char *end, char delim, Book &book, int &fields)
+{
+    fields = 0;
+    while (true)
+    {
+        string *out = fields < FIELD_COUNT ? &(book.*bookFields[fields]) : nullptr;
+        if (delim == ',' && p < end && *p == '"')
+        {
+            if (out)
+                out->clear();
+            p++;
+            while (p < end)
+            {
+                const char *quote = (const char *)memchr(p, '"', end - p);
+                const char *stop = quote ? quote : end;
+                if (out)
+                    out->append(p, stop - p);
+                p = quote ? quote + 1 : end;
+                if (!quote || p == end || *p != '"')
+                    break;
+                if (out)
+                    out->push_back('"'); // "" inside quotes
+                p++;
+            }
+            while (p < end && *p != delim && *p != '\n')
+                p++;
+        }
+        else
+        {
+            const char *stop = p;
+            while (stop < end && *stop != delim && *stop != '\n')
+                stop++;
+            size_t size = stop - p;
+            if (size && p[size - 1] == '\r' && (stop == end || *stop == '\n'))
+                size--;
+            if (out)
+                out->assign(p, size);
+            p = stop;
+        }
+        fields++;
+        if (p < end && *p == delim)
+        {
+            p++;
+            continue;
+        }
+        return p < end ? p + 1 : p;
+    }
+}
+
+// End of the last complete record in data; quoted CSV fields may hold newlines
+size_t lastRecordEnd(const string &data, char delim)
+{
+    if (delim != ',')
+    {
+        size_t nl = data.rfind('\n');
+        return nl == string::npos ? 0 : nl + 1;
+    }
+    size_t cut = 0;
+    bool quoted = false;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        char c = data[i];
+        if (c == '"')
+            quoted = !quoted;
+        else if (c == '\n' && !quoted)
+            cut = i + 1;
+    }
+    return cut;
+}
+
+struct ImportResult
+{
+    size_t records = 0;
+    size_t rejected = 0;
+    size_t added = 0;
+    double seconds = 0;
+};
+
+// Whether a file's first record is the header row exportBooks writes, with
+// every field named in order (case, spaces and underscores aside), rather
+// than a book whose title happens to start with "title"
+bool isHeaderRow(const Book &book)
+{
+    static const char *const names[FIELD_COUNT] = {
+        "title", "author", "publisher", "month", "day", "year", "isbn", "category", "callnumber"};
+    for (int f = 0; f < FIELD_COUNT; f++)
+    {
+        string name;
+        for (char c : book.*bookFields[f])
+            if (isalnum((unsigned char)c))
+                name += tolower((unsigned char)c);
+        if (name != names[f])
+            return false;
+    }
+    return true;
+}
+
+// Streams a CSV or TSV export of the nine Book fields (in display order) into
+// the catalog. The file is read in large blocks cut at record boundaries;
+// worker threads parse and sort the blocks while the next ones are read,
+// with at most two blocks per worker in memory. The sorted runs are merged
+// and handed to bulkLoad. A header row naming the fields is skipped.
+bool importBooks(Catalog &cat, const string &path, ImportResult &result)
+{
+    const size_t BLOCK_SIZE = 8 << 20;
+    LatencyTimer timer(OP_IMPORT, &path);
+    auto start = chrono::steady_clock::now();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        cout << "Error: cannot open " << path << "." << endl;
+        return false;
+    }
+    char delim = path.size() > 4 && toLower(path.substr(path.size() - 4)) == ".tsv" ? '\t' : ',';
+    unsigned workers = thread::hardware_concurrency() ? thread::hardware_concurrency() : 2;
+
+    struct Block
+    {
+        size_t seq;
+        string data;
+    };
+    mutex lock;
+    condition_variable ready, drained;
+    vector<Block> queue;
+    vector<string> freeBuffers;
+    vector<vector<Book>> runs;
+    size_t inFlight = 0;
+    bool done = false;
+
+    auto work = [&] {
+        vector<Book> books;
+        size_t rejected = 0;
+        while (true)
+        {
+            Block block;
+            {
+                unique_lock<mutex> guard(lock);
+                ready.wait(guard, [&] { return done || !queue.empty(); });
+                if (queue.empty())
+                    break;
+                block = std::move(queue.back());
+                queue.pop_back();
+            }
+            TRACE_SPAN("parse block");
+            const char *p = block.data.data(), *end = p + block.data.size();
+            if (block.seq == 0 && p < end)
+            {
+                Book header;
+                int fields;
+                const char *next = parseRecord(p, end, delim, header, fields);
+                if (fields == FIELD_COUNT && isHeaderRow(header))
+                    p = next;
+            }
+            books.clear();
+            Book book;
+            while (p < end)
+            {
+                int fields;
+                const char *next = parseRecord(p, end, delim, book, fields);
+                bool blank = *p == '\n' || (*p == '\r' && next - p <= 2);
+                if (fields == FIELD_COUNT && !book.title.empty())
+                    books.push_back(std::move(book));
+                else if (!blank)
+                    rejected++;
+                p = next;
+            }
+            stable_sort(books.begin(), books.end(), [&](const Book &a, const Book &b)
+                        { return compareKeys(a.title, a.isbn, b.title, b.isbn, cat.keys) < 0; });
+            lock_guard<mutex> guard(lock);
+            if (runs.size() <= block.seq)
+                runs.resize(block.seq + 1);
+            runs[block.seq].swap(books);
+            freeBuffers.push_back(std::move(block.data));
+            inFlight--;
+            result.rejected += rejected;
+            rejected = 0;
+            drained.notify_one();
+        }
+    };
+    vector<thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.emplace_back(work);
+
+    string carry;
+    size_t seq = 0;
+    bool ok = true;
+    while (true)
+    {
+        string data;
+        {
+            unique_lock<mutex> guard(lock);
+            drained.wait(guard, [&] { return inFlight < 2 * workers; });
+            if (!freeBuffers.empty())
+            {
+                data = std::move(freeBuffers.back());
+                freeBuffers.pop_back();
+            }
+        }
+        data.assign(carry);
+        size_t used = data.size();
+        data.resize(used + BLOCK_SIZE);
+        ssize_t n = read(fd, &data[used], BLOCK_SIZE);
+        if (n < 0)
+        {
+            ok = false;
+            break;
+        }
+        data.resize(used + n);
+        size_t cut = n == 0 ? data.size() : lastRecordEnd(data, delim);
+        carry.assign(data, cut, string::npos);
+        data.resize(cut);
+        if (!data.empty())
+        {
+            lock_guard<mutex> guard(lock);
+            queue.push_back({seq++, std::move(data)});
+            inFlight++;
+            ready.notify_one();
+        }
+        if (n == 0)
+            break;
+    }
+    close(fd);
+    {
+        lock_guard<mutex> guard(lock);
+        done = true;
+    }
+    ready.notify_all();
+    for (thread &t : pool)
+        t.join();
+    if (!ok)
+    {
+        cout << "Error: could not read " << path << "." << endl;
+        return false;
+    }
+
+    // Merge the sorted runs pairwise; inplace_merge keeps file order for ties
+    TRACE_SPAN("merge runs");
+    vector<Book> books;
+    vector<size_t> bounds = {0};
+    for (vector<Book> &run : runs)
+    {
+        move(run.begin(), run.end(), back_inserter(books));
+        bounds.push_back(books.size());
+        vector<Book>().swap(run);
+    }
+    auto byKey = [&](const Book &a, const Book &b) { return compareKeys(a.title, a.isbn, b.title, b.isbn, cat.keys) < 0; };
+    for (size_t width = 1; width + 1 < bounds.size(); width *= 2)
+        for (size_t i = 0; i + width + 1 < bounds.size(); i += 2 * width)
+        {
+            size_t last = min(i + 2 * width, bounds.size() - 1);
+            inplace_merge(books.begin() + bounds[i], books.begin() + bounds[i + width],
+                          books.begin() + bounds[last], byKey);
+        }
+    result.records = books.size();
+    result.added = bulkLoad(cat, books);
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+enum ExportFormat
+{
+    EXPORT_JSONL,
+    EXPORT_CSV
+};
+
+// Formats books into a fixed set of 64 KiB slabs that are reused for the
+// whole export and handed to the kernel with one writev per 1 MiB. Nothing
+// is allocated per record. Blocking writes to a slow pipe stall the producer
+// (backpressure); non-blocking descriptors are waited on with poll.
+class ExportWriter
+{
+private:
+    static const size_t SLAB_SIZE = 64 << 10;
+    static const size_t SLAB_COUNT = 16;
+    int fd;
+    ExportFormat format;
+    vector<char> storage;
+    size_t used; // bytes filled across the slabs, in order
+    bool failed;
+
+    void put(const char *data, size_t size)
+    {
+        while (size)
+        {
+            if (used == storage.size())
+                flush();
+            size_t n = min(size, storage.size() - used);
+            memcpy(&storage[used], data, n);
+            used += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    void put(char c)
+    {
+        if (used == storage.size())
+            flush();
+        storage[used++] = c;
+    }
+
+    void putJson(const string &value)
+    {
+        static const char hex[] = "0123456789abcdef";
+        put('"');
+        size_t run = 0;
+        for (size_t i = 0; i < value.size(); i++)
+        {
+            unsigned char c = value[i];
+            if (c >= 0x20 && c != '"' && c != '\\')
+                continue;
+            put(value.data() + run, i - run);
+            run = i + 1;
+            char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            if (c == '"' || c == '\\')
+            {
+                put('\\');
+                put((char)c);
+            }
+            else if (c == '\n')
+                put("\\n", 2);
+            else
+                put(escape, 6);
+        }
+        put(value.data() + run, value.size() - run);
+        put('"');
+    }
+
+    void putCsv(const string &value)
+    {
+        if (value.find_first_of(",\"\r\n") == string::npos)
+        {
+            put(value.data(), value.size());
+            return;
+        }
+        put('"');
+        size_t run = 0;
+        for (size_t q = value.find('"'); q != string::npos; q = value.find('"', q + 1))
+        {
+            put(value.data() + run, q + 1 - run);
+            put('"');
+            run = q + 1;
+        }
+        put(value.data() + run, value.size() - run);
+        put('"');
+    }
+
+public:
+    ExportWriter(int out, ExportFormat fmt)
+        : fd(out), format(fmt), storage(SLAB_SIZE * SLAB_COUNT), used(0), failed(false)
+    {
+        static const char header[] = "title,author,publisher,month,day,year,isbn,category,callNumber\n";
+        if (format == EXPORT_CSV)
+            put(header, sizeof(header) - 1);
+    }
+
+    void add(const Book &book)
+    {
+        static const char *const names[FIELD_COUNT] = {
+            "{\"title\":", ",\"author\":", ",\"publisher\":", ",\"month\":", ",\"day\":",
+            ",\"year\":", ",\"isbn\":", ",\"category\":", ",\"callNumber\":"};
+        for (int f = 0; f < FIELD_COUNT; f++)
+        {
+            if (format == EXPORT_JSONL)
+            {
+                put(names[f], strlen(names[f]));
+                putJson(book.*bookFields[f]);
+            }
+            else
+            {
+                if (f)
+                    put(',');
+                putCsv(book.*bookFields[f]);
+            }
+        }
+        if (format == EXPORT_JSONL)
+            put('}');
+        put('\n');
+    }
+
+    // Appends preformatted text, e.g. a status line between records
+    void addRaw(const string &text)
+    {
+        put(text.data(), text.size());
+    }
+
+    // value as a quoted, escaped JSON string
+    void addJson(const string &value)
+    {
+        putJson(value);
+    }
+
+    // Writes every filled slab; returns false once any write has failed
+    bool flush()
+    {
+        TRACE_SPAN("export write");
+        size_t done = 0;
+        while (!failed && done < used)
+        {
+            iovec iov[SLAB_COUNT];
+            int count = 0;
+            for (size_t at = done; at < used && count < (int)SLAB_COUNT; count++)
+            {
+                size_t end = min(used, (at / SLAB_SIZE + 1) * SLAB_SIZE);
+                iov[count].iov_base = &storage[at];
+                iov[count].iov_len = end - at;
+                at = end;
+            }
+            ssize_t n = writev(fd, iov, count);
+            if (n < 0 && errno == EAGAIN)
+            {
+                pollfd wait = {fd, POLLOUT, 0};
+                poll(&wait, 1, -1);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            failed = n <= 0;
+            done += failed ? 0 : n;
+        }
+        used = 0;
+        return !failed;
+    }
+};
+
+// Streams books with lo <= title < hi (null bounds are open) that pass keep
+template <typename Keep>
+bool exportBooks(const Catalog &cat, int fd, ExportFormat format, const string *lo, const string *hi, Keep keep)
+{
+    ExportWriter writer(fd, format);
+    catalogScan(cat, lo, hi, [&](const Book &book) {
+        if (keep(book))
+            writer.add(book);
+    });
+    return writer.flush();
+}
+
+bool exportBooks(const Catalog &cat, int fd, ExportFormat format)
+{
+    LatencyTimer timer(OP_TRAVERSE);
+    TRACE_SPAN("export");
+    return exportBooks(cat, fd, format, nullptr, nullptr, [](const Book &) { return true; });
+}
+
+// Exports the catalog as parts files named path.0, path.1, ... written in
+// parallel, each holding one contiguous title range of about equal size.
+bool exportParallel(const Catalog &cat, const string &path, ExportFormat format, int parts)
+{
+    size_t total = 0;
+    catalogForEach(cat, [&](const Book &) { total++; });
+    vector<string> bounds; // parts - 1 split titles
+    size_t seen = 0;
+    catalogForEach(cat, [&](const Book &book) {
+        if (seen && (int)bounds.size() < parts - 1 && seen * parts >= (bounds.size() + 1) * total)
+            bounds.push_back(book.title);
+        seen++;
+    });
+    vector<char> ok(bounds.size() + 1, false);
+    vector<thread> threads;
+    for (size_t i = 0; i <= bounds.size(); i++)
+        threads.emplace_back([&, i] {
+            string part = path + "." + to_string(i);
+            int fd = open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                return;
+            const string *lo = i ? &bounds[i - 1] : nullptr;
+            const string *hi = i < bounds.size() ? &bounds[i] : nullptr;
+            ok[i] = exportBooks(cat, fd, format, lo, hi, [](const Book &) { return true; });
+            ok[i] = close(fd) == 0 && ok[i];
+        });
+    for (thread &t : threads)
+        t.join();
+    return find(ok.begin(), ok.end(), false) == ok.end();
+}
+
+struct HeapUsage
+{
+    size_t inUse = 0; // bytes handed out by malloc
+    size_t free = 0;  // bytes the allocator holds but has not handed out
+};
+
+HeapUsage heapUsage()
+{
+    HeapUsage usage;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    usage.inUse = info.uordblks;
+    usage.free = info.fordblks;
+#endif
+    return usage;
+}
+
+size_t heapInUse()
+{
+    return heapUsage().inUse;
+}
+
+struct CatalogStats
+{
+    // Runtime tree
+    size_t nodes = 0;
+    int height = 0;
+    double heightBound = 0;    // worst-case AVL height for this many nodes
+    size_t balance[3] = {};    // nodes with balance factor -1, 0, +1
+    size_t unbalanced = 0;     // anything else means the tree is corrupt
+    double averageDepth = 0;   // root is depth 1
+    int maxDepth = 0;
+    size_t nodeBytes = 0;      // AVLNode structs, including inline (short) strings
+    size_t stringBytes = 0;    // heap buffers of strings too long to store inline
+    // Base layer
+    size_t baseRecords = 0;
+    size_t tombstones = 0;
+    int baseHeight = 0;
+    size_t indexBytes = 0;     // base record/node arrays plus the tombstone bitmap
+    size_t baseStringBytes = 0;
+    // Query cache
+    size_t cachedQueries = 0, cacheBytes = 0;
+    size_t cacheHits = 0, cacheMisses = 0, cacheInvalidations = 0, cacheEvictions = 0;
+    // Allocator
+    HeapUsage heap;
+    double fragmentation = 0;  // share of the allocator's memory sitting free
+};
+
+void queryCacheStats(const Catalog &cat, CatalogStats &stats); // with the query cache
+
+size_t stringHeapBytes(const string &s)
+{
+    return s.capacity() > 15 ? s.capacity() + 1 : 0; // 15 is libstdc++'s inline capacity
+}
+
+// One pass over the runtime tree; the base layer figures come from its header
+CatalogStats catalogStats(const Catalog &cat)
+{
+    CatalogStats stats;
+    size_t depthSum = 0;
+    vector<pair<AVLNode *, int>> stack;
+    if (cat.root)
+        stack.push_back({cat.root, 1});
+    while (!stack.empty())
+    {
+        AVLNode *node = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        stats.nodes++;
+        depthSum += depth;
+        stats.maxDepth = max(stats.maxDepth, depth);
+        int bf = getBalance(node);
+        if (bf >= -1 && bf <= 1)
+            stats.balance[bf + 1]++;
+        else
+            stats.unbalanced++;
+        for (int f = 0; f < FIELD_COUNT; f++)
+            stats.stringBytes += stringHeapBytes(node->book.*bookFields[f]);
+        if (node->left)
+            stack.push_back({node->left, depth + 1});
+        if (node->right)
+            stack.push_back({node->right, depth + 1});
+    }
+    stats.height = getHeight(cat.root);
+    stats.heightBound = stats.nodes ? 1.4405 * log2(stats.nodes + 2) - 0.3277 : 0;
+    stats.averageDepth = stats.nodes ? (double)depthSum / stats.nodes : 0;
+    stats.nodeBytes = stats.nodes * sizeof(AVLNode);
+
+    if (cat.base)
+    {
+        const BaseLayer &base = *cat.base;
+        stats.baseRecords = base.count;
+        stats.baseHeight = base.root == SNAPSHOT_NIL ? 0 : base.nodes[base.root].height;
+        stats.tombstones = count(cat.removed.begin(), cat.removed.end(), true);
+        stats.indexBytes = base.count * (sizeof(SnapshotRecord) + sizeof(SnapshotNode)) + cat.removed.size() / 8;
+        stats.baseStringBytes = base.heapSize;
+    }
+    queryCacheStats(cat, stats);
+    stats.heap = heapUsage();
+    size_t held = stats.heap.inUse + stats.heap.free;
+    stats.fragmentation = held ? (double)stats.heap.free / held : 0;
+    return stats;
+}
+
+void displayStats(const CatalogStats &stats)
+{
+    const string pad = "\t\t\t\t\t\t\t";
+    cout << pad << "Runtime tree: " << stats.nodes << " book(s)\n";
+    cout << pad << "  Height: " << stats.height << " (AVL bound " << fixed << setprecision(1)
+         << stats.heightBound << ")\n";
+    cout << pad << "  Depth: average " << stats.averageDepth << ", max " << stats.maxDepth << "\n";
+    cout << pad << "  Balance factors: -1: " << stats.balance[0] << "  0: " << stats.balance[1]
+         << "  +1: " << stats.balance[2] << "  out of range: " << stats.unbalanced << "\n";
+    cout << pad << "  Node bytes: " << stats.nodeBytes << " (" << sizeof(AVLNode) << " per node)\n";
+    cout << pad << "  String payload bytes: " << stats.stringBytes << "\n";
+    cout << pad << "Base layer: " << stats.baseRecords << " book(s), " << stats.tombstones << " removed\n";
+    cout << pad << "  Height: " << stats.baseHeight << "\n";
+    cout << pad << "  Index bytes: " << stats.indexBytes << "\n";
+    cout << pad << "  String heap bytes: " << stats.baseStringBytes << "\n";
+    size_t lookups = stats.cacheHits + stats.cacheMisses;
+    cout << pad << "Query cache: " << stats.cachedQueries << " queries, " << stats.cacheBytes << " bytes\n";
+    cout << pad << "  Hits: " << stats.cacheHits << " (" << (lookups ? 100.0 * stats.cacheHits / lookups : 0)
+         << "%)  misses: " << stats.cacheMisses << "  invalidated: " << stats.cacheInvalidations
+         << "  evicted: " << stats.cacheEvictions << "\n";
+    cout << pad << "Allocator: " << stats.heap.inUse << " bytes in use, " << stats.heap.free
+         << " free (" << stats.fragmentation * 100 << "% fragmentation)\n";
+    cout << defaultfloat << setprecision(6);
+}
+
+void displayBook(const Book &book)
+{
+    cout << "\t\t\t\t\t\t\t-------------------------------\n";
+    cout << "\t\t\t\t\t\t\tTitle: " << book.title << "\n";
+    cout << "\t\t\t\t\t\t\tAuthor: " << book.author << "\n";
+    cout << "\t\t\t\t\t\t\tPublisher: " << book.publisher << "\n";
+    cout << "\t\t\t\t\t\t\tDate: " << book.month << " " << book.day << ", " << book.year << "\n";
+    cout << "\t\t\t\t\t\t\tISBN: " << book.isbn << "\n";
+    cout << "\t\t\t\t\t\t\tCategory: " << book.category << "\n";
+    cout << "\t\t\t\t\t\t\tCall Number: " << book.callNumber << "\n";  // last displayed
+}
+
+bool bookMatches(const Book &bk, const string &kw)
+{
+    return toLower(bk.title).find(kw) != string::npos ||
+           toLower(bk.author).find(kw) != string::npos ||
+           toLower(bk.publisher).find(kw) != string::npos ||
+           toLower(bk.month).find(kw) != string::npos ||
+           toLower(bk.day).find(kw) != string::npos ||
+           toLower(bk.year).find(kw) != string::npos ||
+           toLower(bk.isbn).find(kw) != string::npos ||
+           toLower(bk.category).find(kw) != string::npos;
+}
+
+// Visits every book with keyword in one of its fields (case-insensitive)
+template <typename Visit>
+void catalogSearch(const Catalog &cat, const string &keyword, Visit visit)
+{
+    COUNT_TIME(SEARCH_NS);
+    LatencyTimer timer(OP_KEYWORD, &keyword);
+    TRACE_SPAN("keyword search");
+    string kw = toLower(keyword);
+    catalogForEach(cat, [&](const Book &bk, BookRef ref) {
+        COUNT(NODES_VISITED, 1);
+        COUNT(COMPARISONS, 8); // bookMatches checks eight fields
+        return !bookMatches(bk, kw) || visitBook(visit, bk, ref);
+    });
+}
+
+void displayAll(const Catalog &cat)
+{
+    LatencyTimer timer(OP_TRAVERSE);
+    TRACE_SPAN("display all");
+    catalogForEach(cat, [](const Book &bk) {
+        TRACE_SPAN("render");
+        displayBook(bk);
+    });
+}
+
+// Query language: whitespace-separated terms that must all hold.
+//   field:value      title, publisher, isbn, callnumber, month, day: contains value
+//   title:value*     title starts with value
+//   author:words     every word is one of the author's words
+//   category:value   category equals value
+//   year:Y  year:A..B  year:A..  year:..B
+//   word or "quoted phrase"   any field contains it, as in catalogSearch
+//   -term            negation
+// Matching is case-insensitive. Values with spaces go in double quotes.
+enum TermKind
+{
+    TERM_CONTAINS,
+    TERM_PREFIX,
+    TERM_WORDS,
+    TERM_EQUALS,
+    TERM_RANGE
+};
+
+struct QueryTerm
+{
+    int field = FIELD_COUNT; // BookField, or FIELD_COUNT for any field
+    TermKind kind = TERM_CONTAINS;
+    bool negate = false;
+    string value; // folded
+    vector<string> words;
+    long lo = LONG_MIN, hi = LONG_MAX;
+    string source; // as written, for explanations
+};
+
+struct QueryStep
+{
+    string action, term;
+    size_t estimated, actual;
+};
+
+struct QueryPlan
+{
+    vector<QueryStep> steps;
+    size_t estimatedRows = 0, actualRows = 0;
+    double millis = 0;
+};
+
+bool parseQuery(const string &text, vector<QueryTerm> &terms, string &error)
+{
+    static const char *const fieldNames[FIELD_COUNT] = {
+        "title", "author", "publisher", "month", "day", "year", "isbn", "category", "callnumber"};
+    size_t i = 0;
+    while (true)
+    {
+        while (i < text.size() && isspace((unsigned char)text[i]))
+            i++;
+        if (i == text.size())
+            break;
+        QueryTerm term;
+        size_t start = i;
+        if (text[i] == '-')
+        {
+            term.negate = true;
+            i++;
+        }
+        string name, value;
+        bool quoted = false;
+        for (bool inValue = false; i < text.size() && !isspace((unsigned char)text[i]);)
+        {
+            if (text[i] == '"')
+            {
+                size_t close = text.find('"', i + 1);
+                if (close == string::npos)
+                {
+                    error = "unterminated quote";
+                    return false;
+                }
+                value += text.substr(i + 1, close - i - 1);
+                quoted = true;
+                inValue = true;
+                i = close + 1;
+            }
+            else if (text[i] == ':' && !inValue)
+            {
+                name = toLower(value);
+                value.clear();
+                inValue = true;
+                i++;
+            }
+            else
+                value += text[i++];
+        }
+        term.source = text.substr(start, i - start);
+        if (!name.empty())
+        {
+            term.field = find(fieldNames, fieldNames + FIELD_COUNT, name) - fieldNames;
+            if (term.field == FIELD_COUNT)
+            {
+                error = "unknown field '" + name + "'";
+                return false;
+            }
+        }
+        if (value.empty())
+        {
+            error = "empty value in '" + term.source + "'";
+            return false;
+        }
+        term.value = toLower(value);
+        if (term.field == YEAR)
+        {
+            size_t dots = value.find("..");
+            string lo = dots == string::npos ? value : value.substr(0, dots);
+            string hi = dots == string::npos ? value : value.substr(dots + 2);
+            char *stop;
+            bool bad = false;
+            if (!lo.empty())
+            {
+                term.lo = strtol(lo.c_str(), &stop, 10);
+                bad = *stop;
+            }
+            if (!hi.empty())
+            {
+                term.hi = strtol(hi.c_str(), &stop, 10);
+                bad = bad || *stop;
+            }
+            if (bad || term.lo > term.hi)
+            {
+                error = "bad year range in '" + term.source + "'";
+                return false;
+            }
+            term.kind = TERM_RANGE;
+        }
+        else if (term.field == TITLE && !quoted && term.value.back() == '*')
+        {
+            term.value.pop_back();
+            term.kind = TERM_PREFIX;
+        }
+        else if (term.field == AUTHOR)
+        {
+            term.kind = TERM_WORDS;
+            foldWords(term.value, term.words);
+            sort(term.words.begin(), term.words.end());
+            term.words.erase(unique(term.words.begin(), term.words.end()), term.words.end());
+        }
+        else if (term.field == CATEGORY)
+            term.kind = TERM_EQUALS;
+        terms.push_back(std::move(term));
+    }
+    if (terms.empty())
+        error = "empty query";
+    return !terms.empty();
+}
+
+bool termMatches(const QueryTerm &term, const Book &book)
+{
+    bool match;
+    if (term.field == FIELD_COUNT)
+        match = bookMatches(book, term.value);
+    else if (term.kind == TERM_RANGE)
+    {
+        char *stop;
+        long year = strtol(book.year.c_str(), &stop, 10);
+        match = !book.year.empty() && !*stop && year >= term.lo && year <= term.hi;
+    }
+    else if (term.kind == TERM_WORDS)
+    {
+        vector<string> words;
+        foldWords(book.author, words);
+        match = all_of(term.words.begin(), term.words.end(), [&](const string &w)
+                       { return find(words.begin(), words.end(), w) != words.end(); });
+    }
+    else
+    {
+        string value = toLower(book.*bookFields[term.field]);
+        if (term.kind == TERM_EQUALS)
+            match = value == term.value;
+        else if (term.kind == TERM_PREFIX)
+            match = value.compare(0, term.value.size(), term.value) == 0;
+        else
+            match = value.find(term.value) != string::npos;
+    }
+    return match != term.negate;
+}
+
+// Recently run queries and their results, most recently used first, so a
+// query repeated between edits costs a lookup. Entries are keyed by their
+// terms in a canonical order and hold the results as BookRefs, which stay
+// valid until their own book is removed. Every change to the catalog drops
+// just the entries whose terms the changed book satisfies, since only
+// their results can differ; the rest survive the edit.
+struct CachedQuery
+{
+    string key;
+    vector<QueryTerm> terms;
+    vector<BookRef> results; // in title order
+    size_t bytes;
+};
+
+const size_t QUERY_CACHE_BYTES = 64 << 20;
+const size_t QUERY_CACHE_ENTRIES = 1024; // each is checked on every change
+
+struct QueryCache
+{
+    list<CachedQuery> entries;
+    unordered_map<string, list<CachedQuery>::iterator> byKey;
+    size_t bytes = 0;
+    size_t hits = 0, misses = 0, invalidations = 0, evictions = 0;
+};
+
+// The same string for any order of the same terms
+string queryKey(const vector<QueryTerm> &terms)
+{
+    vector<string> parts;
+    for (const QueryTerm &term : terms)
+    {
+        string part = string(term.negate ? "-" : "") + to_string(term.field) + ":" + to_string(term.kind) + ":";
+        if (term.kind == TERM_RANGE)
+            part += to_string(term.lo) + ".." + to_string(term.hi);
+        else if (term.kind == TERM_WORDS)
+            for (const string &word : term.words)
+                part += word + " ";
+        else
+            part += term.value;
+        parts.push_back(part);
+    }
+    sort(parts.begin(), parts.end());
+    string key;
+    for (const string &part : parts)
+        key += part + '\0';
+    return key;
+}
+
+void dropEntry(QueryCache &cache, list<CachedQuery>::iterator entry)
+{
+    cache.bytes -= entry->bytes;
+    cache.byKey.erase(entry->key);
+    cache.entries.erase(entry);
+}
+
+// The cache entry for key, or null
+const CachedQuery *findQuery(Catalog &cat, const string &key)
+{
+    if (!cat.queries)
+        cat.queries = new QueryCache;
+    QueryCache &cache = *cat.queries;
+    auto it = cache.byKey.find(key);
+    if (it == cache.byKey.end())
+    {
+        cache.misses++;
+        return nullptr;
+    }
+    cache.hits++;
+    cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+    return &*it->second;
+}
+
+void loadRefs(const Catalog &cat, const vector<BookRef> &refs, vector<Book> &results)
+{
+    Book scratch;
+    results.reserve(results.size() + refs.size());
+    for (BookRef ref : refs)
+        results.push_back(refBook(cat, ref, scratch));
+}
+
+// Called after findQuery missed
+void cacheQuery(Catalog &cat, const string &key, const vector<QueryTerm> &terms, const vector<BookRef> &refs)
+{
+    QueryCache &cache = *cat.queries;
+    size_t bytes = sizeof(CachedQuery) + 2 * key.size() + refs.size() * sizeof(BookRef);
+    for (const QueryTerm &term : terms)
+        bytes += sizeof(QueryTerm) + term.value.size() + term.source.size() + term.words.size() * sizeof(string);
+    if (bytes > QUERY_CACHE_BYTES / 8 || cache.byKey.count(key))
+        return;
+    while (!cache.entries.empty() &&
+           (cache.bytes + bytes > QUERY_CACHE_BYTES || cache.entries.size() >= QUERY_CACHE_ENTRIES))
+    {
+        dropEntry(cache, prev(cache.entries.end()));
+        cache.evictions++;
+    }
+    cache.entries.push_front({key, terms, refs, bytes});
+    cache.byKey[key] = cache.entries.begin();
+    cache.bytes += bytes;
+}
+
+void invalidateQueries(Catalog &cat, const Book &book)
+{
+    if (!cat.queries)
+        return;
+    TRACE_SPAN("invalidate queries");
+    QueryCache &cache = *cat.queries;
+    for (auto it = cache.entries.begin(); it != cache.entries.end();)
+    {
+        auto entry = it++;
+        if (all_of(entry->terms.begin(), entry->terms.end(),
+                   [&](const QueryTerm &term) { return termMatches(term, book); }))
+        {
+            dropEntry(cache, entry);
+            cache.invalidations++;
+        }
+    }
+}
+
+// For bulk loads; checking very many books costs more than the entries save
+void invalidateQueries(Catalog &cat, const vector<const Book *> &books)
+{
+    if (!cat.queries)
+        return;
+    if (books.size() * cat.queries->entries.size() > 1 << 20)
+    {
+        cat.queries->invalidations += cat.queries->entries.size();
+        dropQueries(cat);
+        return;
+    }
+    for (const Book *book : books)
+        invalidateQueries(cat, *book);
+}
+
+// Before removing the titles from lo to hi: drops the entries holding any
+void invalidateQueryRange(Catalog &cat, const string &lo, const string &hi)
+{
+    if (!cat.queries)
+        return;
+    QueryCache &cache = *cat.queries;
+    auto title = [&](BookRef ref)
+    { return ref.node ? string_view(ref.node->book.title) : baseField(*cat.base, ref.record, TITLE); };
+    for (auto it = cache.entries.begin(); it != cache.entries.end();)
+    {
+        auto entry = it++;
+        auto first = partition_point(entry->results.begin(), entry->results.end(),
+                                     [&](BookRef ref) { return compareTitles(title(ref), lo) < 0; });
+        if (first != entry->results.end() && compareTitles(title(*first), hi) <= 0)
+        {
+            dropEntry(cache, entry);
+            cache.invalidations++;
+        }
+    }
+}
+
+void queryCacheStats(const Catalog &cat, CatalogStats &stats)
+{
+    if (!cat.queries)
+        return;
+    const QueryCache &cache = *cat.queries;
+    stats.cachedQueries = cache.entries.size();
+    stats.cacheBytes = cache.bytes;
+    stats.cacheHits = cache.hits;
+    stats.cacheMisses = cache.misses;
+    stats.cacheInvalidations = cache.invalidations;
+    stats.cacheEvictions = cache.evictions;
+}
+
+// Empties the cache, keeping its counters
+void dropQueries(Catalog &cat)
+{
+    if (!cat.queries)
+        return;
+    cat.queries->entries.clear();
+    cat.queries->byKey.clear();
+    cat.queries->bytes = 0;
+}
+
+// One user's run of searches (the menu and batch mode keep one each) and
+// the results of the last. Users narrow a search step by step, "calc",
+// "calcu", "calculus schaum": a query that only narrows the previous one
+// filters its results instead of searching the whole catalog. Anything
+// else, or any change to the catalog in between, searches afresh.
+struct SearchSession
+{
+    vector<QueryTerm> terms;
+    vector<BookRef> results; // in title order
+    uint64_t version = 0;    // of the catalog the results came from
+    bool valid = false;
+    size_t refined = 0, searched = 0;
+};
+
+const size_t SESSION_MAX_RESULTS = 1 << 22; // larger results are not kept
+
+// Whether every book that satisfies a also satisfies b
+bool termImplies(const QueryTerm &a, const QueryTerm &b)
+{
+    if (a.field != b.field || a.kind != b.kind || a.negate != b.negate)
+        return false;
+    if (a.negate)
+    {
+        // Lacking a shorter substring means lacking every longer one too
+        if (a.kind == TERM_CONTAINS)
+            return b.value.find(a.value) != string::npos;
+        return a.value == b.value && a.words == b.words && a.lo == b.lo && a.hi == b.hi;
+    }
+    switch (a.kind)
+    {
+    case TERM_CONTAINS:
+        return a.value.find(b.value) != string::npos;
+    case TERM_PREFIX:
+        return a.value.compare(0, b.value.size(), b.value) == 0;
+    case TERM_WORDS:
+        return all_of(b.words.begin(), b.words.end(), [&](const string &w)
+                      { return find(a.words.begin(), a.words.end(), w) != a.words.end(); });
+    case TERM_EQUALS:
+        return a.value == b.value;
+    case TERM_RANGE:
+        return a.lo >= b.lo && a.hi <= b.hi;
+    }
+    return false;
+}
+
+// Whether terms narrow the session's last search of this catalog
+bool sessionRefines(const Catalog &cat, const SearchSession &session, const vector<QueryTerm> &terms)
+{
+    return session.valid && session.version == cat.version &&
+           all_of(session.terms.begin(), session.terms.end(), [&](const QueryTerm &older) {
+               return any_of(terms.begin(), terms.end(), [&](const QueryTerm &newer) { return termImplies(newer, older); });
+           });
+}
+
+// The session's last results that satisfy terms, which become its last search
+void refineSession(const Catalog &cat, SearchSession &session, const vector<QueryTerm> &terms,
+                   vector<Book> &results)
+{
+    TRACE_SPAN("refine search");
+    Book scratch;
+    size_t kept = 0;
+    for (BookRef ref : session.results)
+    {
+        const Book &book = refBook(cat, ref, scratch);
+        if (all_of(terms.begin(), terms.end(), [&](const QueryTerm &term) { return termMatches(term, book); }))
+        {
+            results.push_back(book);
+            session.results[kept++] = ref;
+        }
+    }
+    session.results.resize(kept);
+    session.terms = terms;
+    session.refined++;
+}
+
+void rememberSearch(const Catalog &cat, SearchSession &session, const vector<QueryTerm> &terms,
+                    vector<BookRef> &refs)
+{
+    session.valid = refs.size() <= SESSION_MAX_RESULTS;
+    session.terms = terms;
+    session.results.clear();
+    if (session.valid)
+        session.results.swap(refs);
+    session.version = cat.version;
+    session.searched++;
+}
+
+// catalogSearch through a session: books with keyword in any field, in title order
+void sessionSearch(Catalog &cat, SearchSession &session, const string &keyword, vector<Book> &results)
+{
+    QueryTerm term;
+    term.value = toLower(keyword);
+    term.source = keyword;
+    vector<QueryTerm> terms = {term};
+    string key = queryKey(terms);
+    vector<BookRef> refs;
+    results.clear();
+    const CachedQuery *cached = findQuery(cat, key);
+    if (cached || sessionRefines(cat, session, terms))
+    {
+        LatencyTimer timer(OP_KEYWORD, &keyword);
+        if (cached)
+        {
+            refs = cached->results;
+            loadRefs(cat, refs, results);
+            rememberSearch(cat, session, terms, refs);
+        }
+        else
+        {
+            refineSession(cat, session, terms, results);
+            cacheQuery(cat, key, terms, session.results);
+        }
+        return;
+    }
+    catalogSearch(cat, keyword, [&](const Book &book, BookRef ref) {
+        results.push_back(book);
+        refs.push_back(ref);
+    });
+    cacheQuery(cat, key, terms, refs);
+    rememberSearch(cat, session, terms, refs);
+}
+
+CatalogIndex &buildIndex(Catalog &cat)
+{
+    if (cat.index)
+        return *cat.index;
+    TRACE_SPAN("build index");
+    CatalogIndex *index = cat.index = new CatalogIndex;
+    index->baseCount = cat.base ? cat.base->count : 0;
+    Book scratch;
+    for (uint32_t record = 0; record < index->baseCount; record++)
+        if (baseLive(cat, record))
+        {
+            loadBaseBook(*cat.base, record, scratch);
+            indexDoc(*index, record, scratch);
+        }
+    vector<AVLNode *> stack;
+    for (AVLNode *n = cat.root; n || !stack.empty(); n = n->right)
+    {
+        for (; n; n = n->left)
+            stack.push_back(n);
+        n = stack.back();
+        stack.pop_back();
+        indexNode(*index, n);
+    }
+    index->titleStep = max<size_t>(1, index->liveCount / 1024);
+    size_t seen = 0;
+    catalogForEach(cat, [&](const Book &book) {
+        if (seen++ % index->titleStep == 0)
+            index->titleSample.push_back(book.title);
+    });
+    return *index;
+}
+
+// Rows the indexes can produce for a positive term, or SIZE_MAX if none can
+size_t estimateTerm(const Catalog &cat, const QueryTerm &term)
+{
+    const CatalogIndex &index = *cat.index;
+    if (term.negate)
+        return SIZE_MAX;
+    if (term.kind == TERM_WORDS && !term.words.empty())
+    {
+        size_t rows = SIZE_MAX;
+        for (const string &word : term.words)
+        {
+            auto it = index.authorWords.find(word);
+            rows = min(rows, it == index.authorWords.end() ? 0 : it->second.size());
+        }
+        return rows;
+    }
+    if (term.kind == TERM_EQUALS && term.field == CATEGORY)
+    {
+        auto it = index.categoryCounts.find(term.value);
+        return it == index.categoryCounts.end() ? 0 : it->second;
+    }
+    if (term.kind == TERM_RANGE)
+    {
+        size_t rows = 0;
+        for (auto it = index.years.lower_bound(max<long>(term.lo, INT_MIN));
+             it != index.years.end() && it->first <= term.hi; ++it)
+            rows += it->second.size();
+        return rows;
+    }
+    if (term.kind == TERM_PREFIX)
+    {
+        auto less = [](const string &a, const string &b) { return compareTitles(a, b) < 0; };
+        string end = prefixEnd(term.value);
+        auto lo = lower_bound(index.titleSample.begin(), index.titleSample.end(), term.value, less);
+        auto hi = lower_bound(index.titleSample.begin(), index.titleSample.end(), end, less);
+        return (hi - lo) * index.titleStep + index.titleStep / 2;
+    }
+    return SIZE_MAX;
+}
+
+// Sorted docs that the index lists for a positive term (stale ones included)
+void termDocs(const Catalog &cat, const QueryTerm &term, vector<uint32_t> &docs)
+{
+    const CatalogIndex &index = *cat.index;
+    if (term.kind == TERM_WORDS)
+    {
+        for (size_t w = 0; w < term.words.size(); w++)
+        {
+            auto it = index.authorWords.find(term.words[w]);
+            if (it == index.authorWords.end())
+            {
+                docs.clear();
+                return;
+            }
+            if (w == 0)
+                docs = it->second;
+            else
+            {
+                vector<uint32_t> both;
+                set_intersection(docs.begin(), docs.end(), it->second.begin(), it->second.end(),
+                                 back_inserter(both));
+                docs.swap(both);
+            }
+        }
+    }
+    else if (term.kind == TERM_EQUALS)
+    {
+        auto it = index.categories.find(term.value);
+        if (it == index.categories.end())
+            return;
+        for (uint32_t word = 0; word < it->second.size(); word++)
+            for (uint64_t bits = it->second[word]; bits; bits &= bits - 1)
+                docs.push_back(word * 64 + __builtin_ctzll(bits));
+    }
+    else if (term.kind == TERM_RANGE)
+    {
+        for (auto it = index.years.lower_bound(max<long>(term.lo, INT_MIN));
+             it != index.years.end() && it->first <= term.hi; ++it)
+            docs.insert(docs.end(), it->second.begin(), it->second.end());
+        sort(docs.begin(), docs.end());
+    }
+}
+
+// Runs a query: the positive indexed term with the smallest estimate drives,
+// cheaper index checks (category bitmaps, author postings) narrow the
+// candidates, and every remaining term is verified on the book itself.
+// Results come back in title order; plan records estimated and actual rows.
+bool runQuery(Catalog &cat, const string &text, vector<Book> &results, QueryPlan &plan, string &error,
+              SearchSession *session = nullptr)
+{
+    vector<QueryTerm> terms;
+    if (!parseQuery(text, terms, error))
+        return false;
+    LatencyTimer timer(OP_QUERY, &text);
+    TRACE_SPAN("query");
+    auto start = chrono::steady_clock::now();
+    string key = queryKey(terms);
+    vector<BookRef> refs;
+    if (const CachedQuery *cached = findQuery(cat, key))
+    {
+        refs = cached->results;
+        loadRefs(cat, refs, results);
+        plan = QueryPlan();
+        plan.steps.push_back({"cached results", text, refs.size(), refs.size()});
+        plan.estimatedRows = plan.actualRows = results.size();
+        plan.millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (session)
+            rememberSearch(cat, *session, terms, refs);
+        return true;
+    }
+    const CatalogIndex &index = buildIndex(cat);
+    double total = max<size_t>(index.liveCount, 1);
+
+    vector<size_t> estimates(terms.size());
+    int driver = -1;
+    for (size_t t = 0; t < terms.size(); t++)
+    {
+        estimates[t] = estimateTerm(cat, terms[t]);
+        if (estimates[t] != SIZE_MAX && (driver < 0 || estimates[t] < estimates[driver]))
+            driver = t;
+    }
+    plan = QueryPlan();
+    // Filtering the previous results beats the indexes only when there are fewer of them
+    if (session && sessionRefines(cat, *session, terms) &&
+        (driver < 0 || session->results.size() <= estimates[driver]))
+    {
+        size_t previous = session->results.size();
+        refineSession(cat, *session, terms, results);
+        cacheQuery(cat, key, terms, session->results);
+        plan.steps.push_back({"refine previous results", text, previous, results.size()});
+        plan.estimatedRows = previous;
+        plan.actualRows = results.size();
+        plan.millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        return true;
+    }
+    double selectivity = 1;
+    for (size_t t = 0; t < terms.size(); t++)
+        if (estimates[t] != SIZE_MAX)
+            selectivity *= min(1.0, estimates[t] / total);
+    plan.estimatedRows = (size_t)(selectivity * total + 0.5);
+
+    vector<bool> checked(terms.size(), false);
+    auto verify = [&](const Book &book, BookRef ref) {
+        for (size_t t = 0; t < terms.size(); t++)
+            if (!termMatches(terms[t], book))
+                return;
+        results.push_back(book);
+        refs.push_back(ref);
+    };
+    if (driver >= 0 && terms[driver].kind == TERM_PREFIX)
+    {
+        // The title tree itself is the index: scan just the prefix range
+        size_t scanned = 0;
+        catalogPrefix(cat, terms[driver].value, [&](const Book &book, BookRef ref) {
+            scanned++;
+            verify(book, ref);
+        });
+        plan.steps.push_back({"title range", terms[driver].source, estimates[driver], scanned});
+    }
+    else if (driver >= 0)
+    {
+        vector<uint32_t> docs;
+        termDocs(cat, terms[driver], docs);
+        docs.erase(remove_if(docs.begin(), docs.end(), [&](uint32_t d) { return !testBit(index.live, d); }),
+                   docs.end());
+        const char *action = terms[driver].kind == TERM_WORDS ? "author index"
+                             : terms[driver].kind == TERM_EQUALS ? "category bitmap" : "year index";
+        plan.steps.push_back({action, terms[driver].source, estimates[driver], docs.size()});
+        checked[driver] = true;
+        for (size_t t = 0; t < terms.size(); t++)
+        {
+            if (checked[t] || estimates[t] == SIZE_MAX || terms[t].kind == TERM_PREFIX)
+                continue;
+            if (terms[t].kind == TERM_EQUALS)
+            {
+                auto it = index.categories.find(terms[t].value);
+                docs.erase(remove_if(docs.begin(), docs.end(), [&](uint32_t d)
+                                     { return it == index.categories.end() || !testBit(it->second, d); }),
+                           docs.end());
+            }
+            else if (terms[t].kind == TERM_WORDS && estimates[t] <= 8 * docs.size())
+            {
+                vector<uint32_t> other, both;
+                termDocs(cat, terms[t], other);
+                set_intersection(docs.begin(), docs.end(), other.begin(), other.end(), back_inserter(both));
+                docs.swap(both);
+            }
+            else
+                continue; // cheaper to verify on the book
+            plan.steps.push_back({terms[t].kind == TERM_EQUALS ? "intersect category bitmap" : "intersect author index",
+                                  terms[t].source, estimates[t], docs.size()});
+        }
+        // Base docs are record numbers and so already in title order; sort
+        // the runtime ones and merge, so results come out in title order
+        auto title = [&](uint32_t doc) {
+            return doc < index.baseCount ? baseField(*cat.base, doc, TITLE)
+                                         : string_view(index.overlayDocs[doc - index.baseCount]->book.title);
+        };
+        auto byTitle = [&](uint32_t a, uint32_t b) { return compareTitles(title(a), title(b)) < 0; };
+        auto runtime = lower_bound(docs.begin(), docs.end(), index.baseCount);
+        sort(runtime, docs.end(), byTitle);
+        inplace_merge(docs.begin(), runtime, docs.end(), byTitle);
+        Book scratch;
+        for (uint32_t doc : docs)
+            verify(docBook(cat, doc, scratch), doc < index.baseCount
+                                                   ? BookRef{nullptr, doc}
+                                                   : BookRef{index.overlayDocs[doc - index.baseCount], 0});
+    }
+    else
+    {
+        size_t scanned = 0;
+        catalogForEach(cat, [&](const Book &book, BookRef ref) {
+            scanned++;
+            verify(book, ref);
+        });
+        plan.steps.push_back({"full scan", "", index.liveCount, scanned});
+    }
+    string verified;
+    for (const QueryTerm &term : terms)
+        verified += (verified.empty() ? "" : " ") + term.source;
+    plan.steps.push_back({"verify", verified, plan.estimatedRows, results.size()});
+    plan.actualRows = results.size();
+    plan.millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cacheQuery(cat, key, terms, refs);
+    if (session)
+        rememberSearch(cat, *session, terms, refs);
+    return true;
+}
+
+void explainQuery(const QueryPlan &plan, ostream &out)
+{
+    out << setw(28) << left << "step" << setw(36) << "term" << setw(12) << "est. rows" << "rows\n";
+    for (const QueryStep &step : plan.steps)
+        out << setw(28) << left << step.action << setw(36)
+            << (step.term.size() > 34 ? step.term.substr(0, 31) + "..." : step.term) << setw(12) << step.estimated
+            << step.actual << "\n";
+    out << "estimated " << plan.estimatedRows << " rows, returned " << plan.actualRows << " in " << fixed
+        << setprecision(3) << plan.millis << " ms\n";
+    out.unsetf(ios::floatfield);
+}
+
+struct RankedBook
+{
+    float score;
+    uint32_t doc;
+};
+
+// BM25 over title, author and category words with field boosts, returning
+// the k best docs, best first. This is Block-Max WAND: one cursor per query
+// word, ordered by current doc. A doc is scored only when the upper bounds
+// of the cursors at or before it could beat the current k-th score, first
+// per term and then per posting block; otherwise cursors jump past the
+// docs that cannot make it, skipping whole blocks at a time.
+void rankBooks(Catalog &cat, const string &text, size_t k, vector<RankedBook> &top)
+{
+    const float K1 = 1.2f, B = 0.75f;
+    const CatalogIndex &index = buildIndex(cat);
+    vector<string> words;
+    foldWords(text, words);
+    sort(words.begin(), words.end());
+    words.erase(unique(words.begin(), words.end()), words.end());
+    top.clear();
+    if (k == 0 || index.liveCount == 0)
+        return;
+    float avgLength = max(1.0, index.totalLength / index.liveCount);
+    auto bm25 = [&](float idf, float tf, float length) {
+        return idf * tf * (K1 + 1) / (tf + K1 * (1 - B + B * length / avgLength));
+    };
+
+    struct Cursor
+    {
+        const TextTerm *term;
+        size_t pos;
+        float idf, upper;
+        uint32_t doc() const { return term->postings[pos].doc; }
+    };
+    vector<Cursor> cursors;
+    for (const string &word : words)
+    {
+        auto it = index.textTerms.find(word);
+        if (it == index.textTerms.end())
+            continue;
+        const TextTerm &term = it->second;
+        float df = term.postings.size();
+        float idf = max(0.0f, log(1 + (index.liveCount - df + 0.5f) / (df + 0.5f)));
+        cursors.push_back({&term, 0, idf, bm25(idf, term.maxTf, term.minLength)});
+    }
+    auto worse = [](const RankedBook &a, const RankedBook &b)
+    { return a.score > b.score || (a.score == b.score && a.doc < b.doc); };
+    auto byDoc = [](const Cursor &a, const Cursor &b) { return a.doc() < b.doc(); };
+    auto seek = [](Cursor &c, uint32_t doc) {
+        const vector<TextPosting> &list = c.term->postings;
+        c.pos = lower_bound(list.begin() + c.pos, list.end(), doc,
+                            [](const TextPosting &p, uint32_t d) { return p.doc < d; }) - list.begin();
+    };
+    sort(cursors.begin(), cursors.end(), byDoc);
+    while (!cursors.empty())
+    {
+        float threshold = top.size() < k ? 0 : top.front().score;
+        float bound = 0;
+        size_t pivot = 0;
+        for (; pivot < cursors.size(); pivot++)
+            if ((bound += cursors[pivot].upper) > threshold)
+                break;
+        if (pivot == cursors.size())
+            break; // nothing left can enter the top k
+        uint32_t pivotDoc = cursors[pivot].doc();
+        while (pivot + 1 < cursors.size() && cursors[pivot + 1].doc() == pivotDoc)
+            pivot++;
+
+        // Block bounds of the cursors that could hold pivotDoc. A leading
+        // cursor whose postings all end below pivotDoc has no such block.
+        float blockBound = 0;
+        uint32_t blockEnd = UINT32_MAX;
+        bool exhausted = false;
+        for (size_t c = 0; c <= pivot && !exhausted; c++)
+        {
+            const vector<TextBlock> &blocks = cursors[c].term->blocks;
+            size_t b = cursors[c].pos / TEXT_BLOCK;
+            while (b < blocks.size() && blocks[b].last < pivotDoc)
+                b++;
+            if (b == blocks.size())
+            {
+                exhausted = true;
+                break;
+            }
+            blockBound += bm25(cursors[c].idf, blocks[b].maxTf, blocks[b].minLength);
+            blockEnd = min(blockEnd, blocks[b].last);
+        }
+
+        size_t moved;
+        if (exhausted)
+        {
+            // Seeking the leaders to pivotDoc runs that cursor off its end,
+            // and the cleanup below drops it
+            for (size_t c = 0; cursors[c].doc() < pivotDoc; c++)
+                seek(cursors[c], pivotDoc);
+            moved = pivot;
+        }
+        else if (blockBound <= threshold)
+        {
+            // No doc before the end of these blocks can make the top k
+            uint32_t target = blockEnd + 1;
+            if (pivot + 1 < cursors.size())
+                target = min(target, cursors[pivot + 1].doc());
+            for (size_t c = 0; c <= pivot; c++)
+                seek(cursors[c], target);
+            moved = pivot + 1;
+        }
+        else if (cursors[0].doc() == pivotDoc)
+        {
+            float score = 0;
+            for (size_t c = 0; c <= pivot; c++)
+            {
+                score += bm25(cursors[c].idf, cursors[c].term->postings[cursors[c].pos].tf,
+                              index.docLength[pivotDoc]);
+                cursors[c].pos++;
+            }
+            if (testBit(index.live, pivotDoc) && (top.size() < k || score > threshold))
+            {
+                top.push_back({score, pivotDoc});
+                push_heap(top.begin(), top.end(), worse);
+                if (top.size() > k)
+                {
+                    pop_heap(top.begin(), top.end(), worse);
+                    top.pop_back();
+                }
+            }
+            moved = pivot + 1;
+        }
+        else
+        {
+            for (size_t c = 0; cursors[c].doc() < pivotDoc; c++)
+                seek(cursors[c], pivotDoc);
+            moved = pivot;
+        }
+        // Only the leading cursors moved: drop finished ones and sink the rest into place
+        for (size_t c = moved; c-- > 0;)
+        {
+            if (cursors[c].pos == cursors[c].term->postings.size())
+            {
+                cursors.erase(cursors.begin() + c);
+                continue;
+            }
+            for (size_t d = c; d + 1 < cursors.size() && byDoc(cursors[d + 1], cursors[d]); d++)
+                swap(cursors[d], cursors[d + 1]);
+        }
+    }
+    sort_heap(top.begin(), top.end(), worse);
+}
+
+// Ranked keyword search as used by the menu and batch mode
+void rankedSearch(Catalog &cat, const string &text, size_t k, vector<pair<float, Book>> &results)
+{
+    string arg = to_string(k) + '\t' + text;
+    LatencyTimer timer(OP_RANKED, &arg);
+    TRACE_SPAN("ranked search");
+    vector<RankedBook> top;
+    rankBooks(cat, text, k, top);
+    results.clear();
+    Book scratch;
+    for (const RankedBook &hit : top)
+        results.emplace_back(hit.score, docBook(cat, hit.doc, scratch));
+}
+
+// Checks rankBooks against scoring every live book exhaustively, for
+// multi-term queries and small k, where the block-max skipping does the
+// most work. Returns the number of queries whose top k differ.
+int checkRanking(Catalog &cat, const vector<string> &queries)
+{
+    const float K1 = 1.2f, B = 0.75f;
+    int failures = 0;
+    for (const string &text : queries)
+        for (size_t k : {1, 2, 3, 5, 10})
+        {
+            const CatalogIndex &index = buildIndex(cat);
+            float avgLength = max(1.0, index.totalLength / index.liveCount);
+            vector<string> words;
+            foldWords(text, words);
+            sort(words.begin(), words.end());
+            words.erase(unique(words.begin(), words.end()), words.end());
+            unordered_map<uint32_t, float> scores;
+            for (const string &word : words)
+            {
+                auto it = index.textTerms.find(word);
+                if (it == index.textTerms.end())
+                    continue;
+                float df = it->second.postings.size();
+                float idf = max(0.0f, log(1 + (index.liveCount - df + 0.5f) / (df + 0.5f)));
+                for (const TextPosting &p : it->second.postings)
+                    if (testBit(index.live, p.doc))
+                        scores[p.doc] += idf * p.tf * (K1 + 1) /
+                                         (p.tf + K1 * (1 - B + B * index.docLength[p.doc] / avgLength));
+            }
+            vector<float> want;
+            for (auto &entry : scores)
+                want.push_back(entry.second);
+            sort(want.begin(), want.end(), greater<float>());
+            want.resize(min(want.size(), k));
+
+            vector<RankedBook> top;
+            rankBooks(cat, text, k, top);
+            bool same = top.size() == want.size();
+            for (size_t i = 0; same && i < top.size(); i++)
+                same = fabs(top[i].score - want[i]) <= 1e-4f * max(1.0f, want[i]);
+            if (!same)
+            {
+                cout << "rank mismatch: k=" << k << " \"" << text << "\": got " << top.size() << ", want "
+                     << want.size() << endl;
+                failures++;
+            }
+        }
+    return failures;
+}
+
+// Typo-tolerant lookup over the ranked-search dictionary. The sorted terms
+// are walked like a trie: each term reuses the edit-distance rows of the
+// prefix it shares with the one before, and once a prefix has no cell
+// within maxEdits every term starting with it is skipped. Distances count
+// code points and adjacent transpositions, so a Cyrillic "о" typed for a
+// Latin "o" is one edit, as is "teh" for "the".
+struct FuzzyMatch
+{
+    const string *term;
+    int distance;
+    size_t docs; // postings, including ones for books since removed
+};
+
+// Decodes the code point at text[i] and moves i past it; stray bytes stand for themselves
+uint32_t nextCodePoint(string_view text, size_t &i)
+{
+    unsigned char c = text[i++];
+    int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    uint32_t point = extra ? c & (0x3f >> extra) : c;
+    for (; extra > 0 && i < text.size() && ((unsigned char)text[i] & 0xc0) == 0x80; extra--)
+        point = point << 6 | ((unsigned char)text[i++] & 0x3f);
+    return point;
+}
+
+// Most edits a lookup may ask for; rows are sized by it
+const int MAX_FUZZY_EDITS = 2;
+
+// Edits allowed for a word of the given length: none for very short words
+int fuzzyEdits(size_t codePoints)
+{
+    return codePoints <= 2 ? 0 : codePoints <= 5 ? 1 : MAX_FUZZY_EDITS;
+}
+
+bool termLive(const CatalogIndex &index, const TextTerm &term)
+{
+    for (const TextPosting &posting : term.postings)
+        if (testBit(index.live, posting.doc))
+            return true;
+    return false;
+}
+
+// Lays out dict's text, start and shared arrays for its sorted entries
+void buildDictionary(TermDictionary &dict)
+{
+    dict.text.clear();
+    dict.start.clear();
+    dict.shared.clear();
+    string_view previous;
+    for (const auto *entry : dict.entries)
+    {
+        const string &term = entry->first;
+        size_t shared = 0;
+        while (shared < 255 && shared < term.size() && shared < previous.size() && term[shared] == previous[shared])
+            shared++;
+        dict.shared.push_back(shared);
+        dict.start.push_back(dict.text.size());
+        dict.text += term;
+        previous = term;
+    }
+    dict.start.push_back(dict.text.size());
+}
+
+// Brings the fuzzy lookup dictionaries up to date with newTerms
+void refreshDictionaries(CatalogIndex &index)
+{
+    const size_t RECENT_LIMIT = 4096;
+    if (!index.terms.start.empty() && index.recentTerms.entries.size() == index.newTerms.size())
+        return;
+    auto byKey = [](const pair<const string, TextTerm> *a, const pair<const string, TextTerm> *b)
+    { return a->first < b->first; };
+    if (!index.terms.start.empty() && index.newTerms.size() <= RECENT_LIMIT)
+    {
+        index.recentTerms.entries = index.newTerms;
+        sort(index.recentTerms.entries.begin(), index.recentTerms.entries.end(), byKey);
+        buildDictionary(index.recentTerms);
+        return;
+    }
+    TRACE_SPAN("build term dictionary");
+    vector<const pair<const string, TextTerm> *> &entries = index.terms.entries;
+    size_t merged = entries.size();
+    sort(index.newTerms.begin(), index.newTerms.end(), byKey);
+    entries.insert(entries.end(), index.newTerms.begin(), index.newTerms.end());
+    inplace_merge(entries.begin(), entries.begin() + merged, entries.end(), byKey);
+    index.newTerms.clear();
+    index.recentTerms.entries.clear();
+    buildDictionary(index.terms);
+    buildDictionary(index.recentTerms);
+}
+
+// Adds the live terms of dict within maxEdits of query to matches
+void walkDictionary(const CatalogIndex &index, const TermDictionary &dict, const vector<uint32_t> &query,
+                    int maxEdits, vector<FuzzyMatch> &matches)
+{
+    // Rows hold the distances of the current prefix to every query prefix,
+    // but only cells within maxEdits of the diagonal are computed: the rest
+    // are over the limit anyway, and one guard cell each side says so
+    const int over = maxEdits + 1;
+    const int m = query.size(), width = m + 1;
+    vector<int> rows(width);
+    for (int j = 0; j < width; j++)
+        rows[j] = min(j, over);
+    vector<uint32_t> ends = {0};   // byte offset after each row's code point
+    vector<uint32_t> points = {0}; // code point behind each row
+    const string_view text = dict.text;
+    const uint8_t *shared = dict.shared.data();
+    const size_t count = dict.entries.size();
+    for (size_t i = 0; i < count;)
+    {
+        // Rows for the bytes shared with the previous term visited are still good
+        while (ends.size() > 1 && ends.back() >= shared[i])
+        {
+            ends.pop_back();
+            points.pop_back();
+        }
+        const string_view term = text.substr(dict.start[i], dict.start[i + 1] - dict.start[i]);
+        bool within = true;
+        for (size_t at = ends.back(); at < term.size() && within;)
+        {
+            uint32_t point = nextCodePoint(term, at);
+            int depth = ends.size();
+            ends.push_back(at);
+            points.push_back(point);
+            rows.resize((depth + 1) * width);
+            int *row = &rows[depth * width], *above = row - width;
+            int lo = max(1, depth - maxEdits), hi = min(m, depth + maxEdits);
+            row[lo - 1] = lo == 1 ? min(depth, over) : over;
+            if (hi < m)
+                row[hi + 1] = over;
+            int best = row[lo - 1];
+            for (int j = lo; j <= hi; j++)
+            {
+                int cost = min({above[j] + 1, row[j - 1] + 1, above[j - 1] + (query[j - 1] != point)});
+                if (depth > 1 && j > 1 && point == query[j - 2] && points[depth - 1] == query[j - 1])
+                    cost = min(cost, rows[(depth - 2) * width + j - 2] + 1);
+                row[j] = min(cost, over);
+                best = min(best, row[j]);
+            }
+            within = best <= maxEdits;
+        }
+        if (!within)
+        {
+            // Nothing that starts with this prefix can come back within
+            // maxEdits: skip to the first term that shares less of it
+            size_t length = ends.back(), j = i + 1;
+            if (length <= 128)
+            {
+                const uint64_t ones = ~0ull / 255;
+                for (uint64_t x; j + 8 <= count; j += 8)
+                {
+                    memcpy(&x, shared + j, 8);
+                    if ((x - ones * length) & ~x & ones * 128)
+                        break; // some byte is below length
+                }
+            }
+            while (j < count && shared[j] >= length)
+                j++;
+            i = j;
+            continue;
+        }
+        int depth = ends.size() - 1, distance = rows[depth * width + m];
+        const auto *entry = dict.entries[i];
+        if (depth + maxEdits >= m && distance <= maxEdits && termLive(index, entry->second))
+            matches.push_back({&entry->first, distance, entry->second.postings.size()});
+        i++;
+    }
+}
+
+// Live dictionary terms within maxEdits of word, closest first, then by books.
+// maxEdits is clamped to 0..MAX_FUZZY_EDITS.
+void fuzzyLookup(Catalog &cat, const string &word, int maxEdits, vector<FuzzyMatch> &matches)
+{
+    maxEdits = clamp(maxEdits, 0, MAX_FUZZY_EDITS);
+    string arg = to_string(maxEdits) + '\t' + word;
+    LatencyTimer timer(OP_FUZZY, &arg);
+    TRACE_SPAN("fuzzy lookup");
+    CatalogIndex &index = buildIndex(cat);
+    refreshDictionaries(index);
+    string folded = toLower(word);
+    vector<uint32_t> query;
+    for (size_t i = 0; i < folded.size();)
+        query.push_back(nextCodePoint(folded, i));
+    matches.clear();
+    walkDictionary(index, index.terms, query, maxEdits, matches);
+    walkDictionary(index, index.recentTerms, query, maxEdits, matches);
+    sort(matches.begin(), matches.end(), [](const FuzzyMatch &a, const FuzzyMatch &b) {
+        if (a.distance != b.distance)
+            return a.distance < b.distance;
+        return a.docs != b.docs ? a.docs > b.docs : *a.term < *b.term;
+    });
+}
+
+// text with each word the catalog does not know replaced by its closest
+// known term; empty when no word needed (or found) a correction
+string correctQuery(Catalog &cat, const string &text)
+{
+    vector<string> words;
+    foldWords(text, words);
+    string corrected;
+    bool changed = false;
+    vector<FuzzyMatch> matches;
+    for (const string &word : words)
+    {
+        size_t length = 0;
+        for (size_t i = 0; i < word.size(); length++)
+            nextCodePoint(word, i);
+        const CatalogIndex &index = buildIndex(cat);
+        auto known = index.textTerms.find(word);
+        bool keep = known != index.textTerms.end() && termLive(index, known->second);
+        if (!keep)
+            fuzzyLookup(cat, word, fuzzyEdits(length), matches);
+        string replacement = keep || matches.empty() ? word : *matches.front().term;
+        changed |= replacement != word;
+        corrected += (corrected.empty() ? "" : " ") + replacement;
+    }
+    return changed ? corrected : "";
+}
+
+CompletionIndex &buildCompletions(Catalog &cat)
+{
+    if (cat.completions)
+        return *cat.completions;
+    TRACE_SPAN("build completions");
+    CompletionIndex &ci = *(cat.completions = new CompletionIndex);
+    // Count every book first, then fill the lists once, children before parents
+    uint32_t records = cat.base ? cat.base->count : 0;
+    for (uint32_t record = 0; record < records; record++)
+        if (baseLive(cat, record))
+            ci.authors[authorEntry(ci, string(baseField(*cat.base, record, AUTHOR)))].books++;
+    vector<AVLNode *> nodes;
+    for (AVLNode *n = cat.root; n || !nodes.empty(); n = n->right)
+    {
+        for (; n; n = n->left)
+            nodes.push_back(n);
+        n = nodes.back();
+        nodes.pop_back();
+        ci.authors[authorEntry(ci, n->book.author)].books++;
+    }
+    vector<pair<uint32_t, bool>> stack = {{0, false}};
+    while (!stack.empty())
+    {
+        auto [node, childrenDone] = stack.back();
+        stack.pop_back();
+        if (childrenDone)
+        {
+            refillTop(ci, node);
+            continue;
+        }
+        stack.push_back({node, true});
+        for (uint32_t child : ci.nodes[node].children)
+            stack.push_back({child, false});
+    }
+    return ci;
+}
+
+enum CompletionOrder
+{
+    BY_POPULARITY,
+    BY_TITLE
+};
+
+struct Completion
+{
+    string text;
+    uint32_t books; // by the author, or 1 for a title
+    bool author;
+};
+
+// Up to limit (at most COMPLETION_TOP) titles and authors that start with
+// prefix, ignoring case; authors also match from any word of the name.
+// BY_POPULARITY puts the authors with the most books first, a title
+// counting as one book; BY_TITLE lists everything alphabetically.
+void autocomplete(Catalog &cat, const string &prefix, size_t limit, CompletionOrder order, vector<Completion> &out)
+{
+    string arg = to_string(limit) + '\t' + (order == BY_TITLE ? "title" : "popular") + '\t' + prefix;
+    LatencyTimer timer(OP_COMPLETE, &arg);
+    TRACE_SPAN("autocomplete");
+    const CompletionIndex &ci = buildCompletions(cat);
+    limit = min(limit, COMPLETION_TOP);
+    out.clear();
+    if (!limit)
+        return;
+    string key = foldKey(prefix);
+    vector<pair<string, Completion>> candidates; // with the folded text they sort by
+
+    // The radix node whose subtree holds every author key starting with
+    // prefix, and the key it stands for
+    uint32_t node = 0;
+    string path;
+    for (size_t at = 0; at < key.size() && node != UINT32_MAX;)
+    {
+        uint32_t child = completionChild(ci, node, key[at]);
+        const string &label = ci.nodes[child].label;
+        size_t common = 1;
+        while (child && common < label.size() && at + common < key.size() && label[common] == key[at + common])
+            common++;
+        node = child && (common == label.size() || at + common == key.size()) ? child : UINT32_MAX;
+        path += label;
+        at += common;
+    }
+    if (node != UINT32_MAX && order == BY_POPULARITY)
+        for (size_t i = 0; i < ci.nodes[node].top.size() && i < limit; i++)
+        {
+            const AuthorEntry &entry = ci.authors[ci.nodes[node].top[i]];
+            candidates.push_back({entry.folded, {entry.name, entry.books, true}});
+        }
+    else if (node != UINT32_MAX)
+    {
+        // Depth first in label order, so keys come out sorted
+        vector<uint32_t> seen;
+        vector<pair<uint32_t, string>> stack = {{node, path}};
+        while (!stack.empty() && seen.size() < limit)
+        {
+            auto [at, path] = std::move(stack.back());
+            stack.pop_back();
+            vector<uint32_t> authors = ci.nodes[at].authors;
+            sort(authors.begin(), authors.end(),
+                 [&](uint32_t a, uint32_t b) { return ci.authors[a].folded < ci.authors[b].folded; });
+            for (uint32_t id : authors)
+                if (ci.authors[id].books && seen.size() < limit && find(seen.begin(), seen.end(), id) == seen.end())
+                {
+                    seen.push_back(id);
+                    candidates.push_back({path, {ci.authors[id].name, ci.authors[id].books, true}});
+                }
+            const vector<uint32_t> &children = ci.nodes[at].children;
+            for (auto child = children.rbegin(); child != children.rend(); ++child)
+                stack.push_back({*child, path + ci.nodes[*child].label});
+        }
     }
-    searchBooks(root->left, keyword, found);
-    searchBooks(root->right, keyword, found);
-}
 
-void displayAll(AVLNode *root)
-{
-    if (!root)
-        return;
-    displayAll(root->left);
-    displayBook(root->book);
-    displayAll(root->right);
+    string end = prefixEnd(prefix);
+    size_t titles = 0;
+    catalogScan(cat, &prefix, &end, [&](const Book &book) {
+        if (titles && compareTitles(book.title, candidates.back().second.text) == 0)
+            return true; // another edition of the title just offered
+        candidates.push_back({foldKey(book.title), {book.title, 1, false}});
+        return ++titles < limit;
+    });
+    stable_sort(candidates.begin(), candidates.end(), [&](const auto &a, const auto &b) {
+        if (order == BY_POPULARITY && a.second.books != b.second.books)
+            return a.second.books > b.second.books;
+        return a.first < b.first;
+    });
+    for (size_t i = 0; i < candidates.size() && i < limit; i++)
+        out.push_back(std::move(candidates[i].second));
 }
 
 // Interface Functions
@@ -264,7 +4003,8 @@ void titleScreen()
 }
 
 
-void menu(AVLNode*& root) {
+// Returns false once the user chooses to exit
+bool menu(Catalog &cat, SearchSession &session) {
     const int BOX_WIDTH = 60;
     int choice;
     Book b;
@@ -287,7 +4027,13 @@ void menu(AVLNode*& root) {
     cout << "\t\t\t\t\t\t\t\t2. View all books" << endl;
     cout << "\t\t\t\t\t\t\t\t3. Add a book" << endl;
     cout << "\t\t\t\t\t\t\t\t4. Remove a book" << endl;
-    cout << "\t\t\t\t\t\t\t\t5. Exit" << endl;
+    cout << "\t\t\t\t\t\t\t\t5. Remove a range of books" << endl;
+    cout << "\t\t\t\t\t\t\t\t6. Import books from a CSV/TSV file" << endl;
+    cout << "\t\t\t\t\t\t\t\t7. Export books to a CSV/JSONL file" << endl;
+    cout << "\t\t\t\t\t\t\t\t8. Show catalog statistics" << endl;
+    cout << "\t\t\t\t\t\t\t\t9. Query books with field filters" << endl;
+    cout << "\t\t\t\t\t\t\t\t10. Autocomplete titles and authors" << endl;
+    cout << "\t\t\t\t\t\t\t\t11. Exit" << endl;
     cout << "\t\t\t\t\t\t\t|-=================================-|" << endl;
     cout << "\t\t\t\t\t\t\t\tChoose an option: ";
     cin >> choice;
@@ -308,10 +4054,35 @@ if (keyword.length() > BOX_WIDTH)
 
 
 {
-    bool found = false;
-    searchBooks(root, keyword, found);
+    // Best matches first; fall back to the substring search for partial
+    // words, ISBNs and the like that the word index cannot match
+    const size_t TOP_K = 10;
+    vector<pair<float, Book>> ranked;
+    rankedSearch(cat, keyword, TOP_K, ranked);
+    for (const pair<float, Book> &hit : ranked)
+        displayBook(hit.second);
+    bool found = !ranked.empty();
+    if (!found)
+    {
+        vector<Book> matches;
+        sessionSearch(cat, session, keyword, matches);
+        for (const Book &book : matches)
+            displayBook(book);
+        found = !matches.empty();
+    }
+    string corrected = found ? "" : correctQuery(cat, keyword);
+    if (!corrected.empty())
+    {
+        rankedSearch(cat, corrected, TOP_K, ranked);
+        cout << "No exact matches. Showing results for \"" << corrected << "\":\n";
+        for (const pair<float, Book> &hit : ranked)
+            displayBook(hit.second);
+        found = !ranked.empty();
+    }
     if (!found)
         cout << "No matching book found.\n";
+    else if (ranked.size() == TOP_K)
+        cout << "Showing the " << TOP_K << " best matches.\n";
 }
 
 cout << "Press Enter to continue.";
@@ -320,7 +4091,7 @@ system("clear");
 break;
     case 2:
         cout << "\nAll Books in Catalog:\n";
-        displayAll(root);
+        displayAll(cat);
         cout << "Press Enter to continue.";
         cin.get();
         system("clear");
@@ -354,8 +4125,11 @@ cout << "Enter Call Number: ";
 getline(cin, b.callNumber);  // last input
 
 
-        root = insert(root, b);
-        cout << "Book added!\n";
+        if (catalogAdd(cat, b))
+            cout << "Book added!\n";
+        else
+            cout << (cat.keys == KEY_TITLE_ISBN ? "That edition is already in the catalog.\n"
+                                                : "A book with that title is already in the catalog.\n");
         cout << "Press Enter to continue.";
         cin.get();
         system("clear");
@@ -363,16 +4137,156 @@ getline(cin, b.callNumber);  // last input
     case 4:
         cout << "Enter Title to delete: ";
         getline(cin, keyword);
-        root = deleteNode(root, keyword);
+        if (cat.keys == KEY_TITLE_ISBN)
+        {
+            string isbn;
+            cout << "Enter ISBN of the edition (blank for every edition): ";
+            getline(cin, isbn);
+            catalogRemove(cat, keyword, isbn.empty() ? nullptr : &isbn);
+        }
+        else
+            catalogRemove(cat, keyword);
         cout << "Book deleted (if it existed).\n";
         cout << "Press Enter to continue.";
         cin.get();
         system("clear");
         break;
     case 5:
+    {
+        string lo, hi;
+        cout << "Enter first Title of the range: ";
+        getline(cin, lo);
+        cout << "Enter last Title of the range: ";
+        getline(cin, hi);
+        int removed = catalogEraseRange(cat, lo, hi);
+        cout << removed << " book(s) removed.\n";
+        cout << "Press Enter to continue.";
+        cin.get();
+        system("clear");
+        break;
+    }
+    case 6:
+    {
+        cout << "Enter the path of the CSV/TSV file: ";
+        getline(cin, keyword);
+        ImportResult result;
+        if (importBooks(cat, keyword, result))
+            cout << result.records << " record(s) read, " << result.added << " book(s) added, "
+                 << result.rejected << " malformed line(s) skipped in " << result.seconds << "s.\n";
+        cout << "Press Enter to continue.";
+        cin.get();
+        system("clear");
+        break;
+    }
+    case 7:
+    {
+        cout << "Enter the path to export to (.csv or .jsonl): ";
+        getline(cin, keyword);
+        bool csv = keyword.size() > 4 && toLower(keyword.substr(keyword.size() - 4)) == ".csv";
+        ExportFormat format = csv ? EXPORT_CSV : EXPORT_JSONL;
+        int fd = open(keyword.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool exported = fd >= 0 && exportBooks(cat, fd, format);
+        if (fd >= 0)
+            exported = close(fd) == 0 && exported;
+        cout << (exported ? "Catalog exported.\n" : "Error: could not write the file.\n");
+        cout << "Press Enter to continue.";
+        cin.get();
+        system("clear");
+        break;
+    }
+    case 8:
+    {
+        displayStats(catalogStats(cat));
+        dumpLatencies(cout);
+        if (!countersEnabled())
+            cout << "Counters are compiled out; rebuild with -DCATALOG_COUNTERS.\n";
+        array<uint64_t, COUNTER_COUNT> totals = readCounters();
+        for (int c = 0; c < COUNTER_COUNT; c++)
+            cout << "\t\t\t\t\t\t\t" << setw(20) << left << counterNames[c] << totals[c] << "\n";
+        cout << "Press Enter to continue.";
+        cin.get();
+        system("clear");
+        break;
+    }
+    case 9:
+    {
+        cout << "\nQuery, e.g. author:\"Spiegel\" category:Physics year:1990..2005 -title:outline\n> ";
+        getline(cin, keyword);
+        vector<Book> found;
+        QueryPlan plan;
+        string error;
+        if (!runQuery(cat, keyword, found, plan, error, &session))
+            cout << "Invalid query: " << error << ".\n";
+        else
+        {
+            for (const Book &book : found)
+                displayBook(book);
+            if (found.empty())
+                cout << "No matching book found.\n";
+            cout << "\n";
+            explainQuery(plan, cout);
+        }
+        cout << "Press Enter to continue.";
+        cin.get();
+        system("clear");
+        break;
+    }
+    case 10:
+    {
+        // On a terminal the suggestions follow every keystroke; otherwise a
+        // whole line is taken as the prefix
+        const size_t SHOWN = 10;
+        vector<Completion> completions;
+        auto show = [&](const string &prefix) {
+            autocomplete(cat, prefix, SHOWN, BY_POPULARITY, completions);
+            for (const Completion &c : completions)
+                cout << "  " << c.text
+                     << (c.author ? " (author, " + to_string(c.books) + (c.books == 1 ? " book)" : " books)") : "")
+                     << "\n";
+        };
+        string prefix;
+        termios saved;
+        if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0)
+        {
+            cout << "\nStart of a title or author: ";
+            getline(cin, prefix);
+            show(prefix);
+        }
+        else
+        {
+            termios raw = saved;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+            while (true)
+            {
+                cout << "\033[H\033[J" << "Type a title or author (Enter to finish)\n> " << prefix << "\n\n";
+                show(prefix);
+                cout << flush;
+                int c = cin.get();
+                if (c == EOF || c == '\n' || c == 27)
+                    break;
+                if (c == 127 || c == '\b')
+                {
+                    // Drop the whole last UTF-8 character
+                    while (!prefix.empty() && ((unsigned char)prefix.back() & 0xc0) == 0x80)
+                        prefix.pop_back();
+                    if (!prefix.empty())
+                        prefix.pop_back();
+                }
+                else if (c >= 0x20)
+                    prefix += (char)c;
+            }
+            tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        }
+        cout << "Press Enter to continue.";
+        cin.get();
+        system("clear");
+        break;
+    }
+    case 11:
         cout << "Exiting..." << endl;
         this_thread::sleep_for(chrono::seconds(2));
-        exit(0);
+        return false;
         default:
             cout << "Invalid option. Try again." << endl;
             cin.clear();
@@ -380,13 +4294,16 @@ getline(cin, b.callNumber);  // last input
             system("clear");
             break;
     }
+    return true;
 }
 
-int main()
+// Initial books, turned into a read-only base layer at compile time
+struct SeedBook
 {
-    AVLNode *root = nullptr;
-    // Initial books
-   vector<Book> books = {
+    string_view fields[FIELD_COUNT];
+};
+
+constexpr SeedBook seedBooks[] = {
     {"The Logic and Design of Computer Programs", "Jim Messinger", "Pearson", "October", "15", "2004", "9781576761304", "Computer Science", "QA 76.6 M47 2005"},
     {"C Interfaces and Implementations", "David R. Hanson", "Addison-Wesley Professional", "August", "20", "1996", "9780201498417", "Computer Science", "QA 76.73 C15H37 1997"},
     {"Software Engineering: A Practitioner’s Approach", "Roger S. Pressman", "McGraw-Hill Companies", "January", "1", "1996", "9780070521827", "Computer Science", "QA 76.6 P72 1997"},
@@ -432,14 +4349,846 @@ int main()
     {"Naruto", "Masashi Kishimoto", "Shueisha", "September", "21", "1999", "9780000002", "Manga", "QA76.73.C16"}
 };
 
-    for (Book b : books)
-        root = insert(root, b);
+const uint32_t SEED_COUNT = sizeof(seedBooks) / sizeof(seedBooks[0]);
 
-    titleScreen();
-    while (true)
+constexpr size_t seedHeapSize()
+{
+    size_t size = 0;
+    for (const SeedBook &book : seedBooks)
+        for (const string_view &field : book.fields)
+            size += field.size();
+    return size;
+}
+
+// Same layout as a mapped snapshot, so the catalog code cannot tell them apart
+struct SeedImage
+{
+    array<char, seedHeapSize()> heap;
+    array<SnapshotRecord, SEED_COUNT> records;
+    array<SnapshotNode, SEED_COUNT> nodes;
+    uint32_t root;
+    bool unique; // false if two seed books share a title
+};
+
+constexpr uint32_t buildSeedNodes(SeedImage &image, uint32_t lo, uint32_t hi)
+{
+    if (lo >= hi)
+        return SNAPSHOT_NIL;
+    uint32_t mid = lo + (hi - lo) / 2;
+    uint32_t left = buildSeedNodes(image, lo, mid);
+    uint32_t right = buildSeedNodes(image, mid + 1, hi);
+    int32_t lh = left == SNAPSHOT_NIL ? 0 : image.nodes[left].height;
+    int32_t rh = right == SNAPSHOT_NIL ? 0 : image.nodes[right].height;
+    image.nodes[mid] = {left, right, (lh > rh ? lh : rh) + 1};
+    return mid;
+}
+
+constexpr SeedImage buildSeedImage()
+{
+    SeedImage image = {};
+    array<uint32_t, SEED_COUNT> order = {};
+    for (uint32_t i = 0; i < SEED_COUNT; i++)
+    {
+        uint32_t j = i;
+        for (; j > 0 && compareTitles(seedBooks[i].fields[TITLE], seedBooks[order[j - 1]].fields[TITLE]) < 0; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    image.unique = true;
+    uint32_t used = 0;
+    for (uint32_t r = 0; r < SEED_COUNT; r++)
+    {
+        const SeedBook &book = seedBooks[order[r]];
+        if (r > 0 && compareTitles(book.fields[TITLE], seedBooks[order[r - 1]].fields[TITLE]) == 0)
+            image.unique = false;
+        for (int f = 0; f < FIELD_COUNT; f++)
+        {
+            image.records[r].fields[f] = {used, (uint32_t)book.fields[f].size()};
+            for (char c : book.fields[f])
+                image.heap[used++] = c;
+        }
+    }
+    image.root = buildSeedNodes(image, 0, SEED_COUNT);
+    return image;
+}
+
+constexpr SeedImage seedImage = buildSeedImage();
+static_assert(seedImage.unique, "seed books must have distinct titles");
+
+const BaseLayer seedLayer = {seedImage.records.data(), seedImage.nodes.data(), seedImage.heap.data(),
+                             SEED_COUNT, seedImage.root, seedImage.heap.size()};
+
+// Deterministic synthetic catalog for benchmarks. Titles, authors, publishers
+// and categories are drawn from Zipf-weighted word lists, so a few names are
+// very common and most are rare, as in a real collection. The generator is a
+// plain splitmix64, so a seed gives the same books on every platform.
+class BookGenerator
+{
+private:
+    uint64_t state;
+    vector<double> wordCdf, lastNameCdf, publisherCdf, categoryCdf;
+
+    static vector<double> zipfCdf(size_t n)
+    {
+        vector<double> cdf(n);
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+            cdf[i] = sum += 1.0 / (i + 1);
+        for (double &c : cdf)
+            c /= sum;
+        return cdf;
+    }
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    size_t pick(const vector<double> &cdf)
+    {
+        double u = (next() >> 11) * (1.0 / 9007199254740992.0);
+        size_t i = upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return i < cdf.size() ? i : cdf.size() - 1;
+    }
+
+public:
+    static const vector<string> &words()
+    {
+        static const vector<string> list = {
+            "Introduction", "Physics", "Calculus", "Theory", "Modern", "Engineering", "Design",
+            "Systems", "Analysis", "Principles", "Applied", "Mathematics", "Computer", "Science",
+            "Chemistry", "Quantum", "Mechanics", "Statistics", "Fundamentals", "Advanced",
+            "Thermodynamics", "Algorithms", "Data", "Structures", "Programming", "Elementary",
+            "Linear", "Algebra", "Discrete", "Organic", "Nuclear", "Solid", "State", "Materials",
+            "Construction", "Architecture", "Management", "Control", "Signals", "Networks",
+            "Economics", "History", "Handbook", "Methods", "Practical", "Foundations", "Digital",
+            "Electronics", "Biology", "Molecular", "Geometry", "Topology", "Probability",
+            "Optimization", "Numerical", "Software", "Compilers", "Operating", "Databases",
+            "Graphics", "Ergonomics", "Logistics", "Retrofitting", "Structural", "Fluid",
+            "Dynamics", "Heat", "Transfer", "Energy", "Power", "Environmental", "Sustainable",
+            "Human", "Factors", "Game", "Automata", "Complex", "Functional", "Domain", "Outline"};
+        return list;
+    }
+
+    explicit BookGenerator(uint64_t seed) : state(seed)
+    {
+        wordCdf = zipfCdf(words().size());
+        lastNameCdf = zipfCdf(40);
+        publisherCdf = zipfCdf(24);
+        categoryCdf = zipfCdf(12);
+    }
+
+    Book make()
+    {
+        static const char *const firstNames[] = {
+            "John", "Mary", "David", "Paul", "Susan", "James", "Linda", "Michael", "Karen", "Robert",
+            "Elliott", "Dilip", "Noam", "Joel", "George", "Murray", "Samuel", "Dennis", "Allan", "Erik"};
+        static const char *const lastNames[] = {
+            "Smith", "Wong", "Thomas", "Spiegel", "Hewitt", "Perkins", "Kinney", "Black", "Hartley",
+            "Mandal", "Blanchard", "Sullivan", "Douglas", "Finch", "Riley", "Burton", "Marshall",
+            "Pressman", "Mall", "Hanson", "Nisan", "Schiff", "Meduna", "McFedries", "Wackerly",
+            "Kamm", "Aslaksen", "Karwowski", "Guastello", "Bluman", "Domel", "Oda", "Kishimoto",
+            "Merzbacher", "Kondepudi", "Rubinson", "Kasparek", "Edmonds", "Siceloff", "Schreier"};
+        static const char *const publishers[] = {
+            "Pearson", "McGraw-Hill", "Wiley", "Addison-Wesley", "Cambridge University Press",
+            "CRC Press", "Springer", "Prentice Hall", "Oxford University Press", "Dover Publications",
+            "Elsevier", "MIT Press", "O'Reilly Media", "No Starch Press", "Auerbach Publications",
+            "Wiley-Interscience", "John Wiley & Sons", "Delmar Pub", "Duxbury Press", "Shueisha",
+            "Butterworth-Heinemann", "Merchant Books", "New Age International", "For Dummies"};
+        static const char *const categories[] = {
+            "Computer Science", "Physics", "Mathematics", "Engineering", "Chemistry", "Architecture",
+            "Biology", "Economics", "History", "Manga", "Literature", "Medicine"};
+        static const char *const months[] = {
+            "January", "February", "March", "April", "May", "June", "July", "August", "September",
+            "October", "November", "December"};
+
+        Book book;
+        int count = 2 + next() % 5;
+        for (int w = 0; w < count; w++)
+        {
+            if (w)
+                book.title += (w == 2 && next() % 4 == 0) ? ": " : " ";
+            book.title += words()[pick(wordCdf)];
+        }
+        book.author = string(firstNames[next() % 20]) + " " + lastNames[pick(lastNameCdf)];
+        book.publisher = publishers[pick(publisherCdf)];
+        book.month = months[next() % 12];
+        book.day = to_string(1 + next() % 28);
+        int year = 2024 - (int)(next() % 75) * (int)(next() % 75) / 74; // skewed to recent years
+        book.year = to_string(year);
+        book.isbn = "978" + to_string(1000000000 + next() % 9000000000ull);
+        book.category = categories[pick(categoryCdf)];
+        book.callNumber = "QA " + to_string(1 + next() % 999) + " " + book.author.substr(book.author.rfind(' ') + 1, 1) +
+                          to_string(10 + next() % 90) + " " + book.year;
+        return book;
+    }
+
+    // n books with distinct keys. Under KEY_TITLE a repeated title gets a
+    // volume number; under KEY_TITLE_ISBN it is kept as another edition.
+    vector<Book> generate(size_t n, KeyPolicy keys = KEY_TITLE)
+    {
+        vector<Book> books;
+        books.reserve(n);
+        unordered_map<string, int> seen;
+        while (books.size() < n)
+        {
+            Book book = make();
+            if (keys == KEY_TITLE_ISBN)
+            {
+                if (seen[book.isbn]++ == 0)
+                    books.push_back(std::move(book));
+                continue;
+            }
+            int volume = seen[toLower(book.title)]++;
+            if (volume)
+            {
+                book.title += " (Vol. " + to_string(volume + 1) + ")";
+                if (seen.count(toLower(book.title)))
+                    continue;
+                seen[toLower(book.title)] = 1;
+            }
+            books.push_back(std::move(book));
+        }
+        return books;
+    }
+};
+
+// Runs every core catalog operation on generated catalogs of each size and
+// prints one JSON document, so results can be diffed between releases.
+// Backends: "avl" (runtime tree) and "snapshot" (mapped base layer); key
+// policies: "folded-title" (distinct titles) and "folded-title+isbn"
+// (titles repeat as editions).
+void runBenchmark(const vector<size_t> &sizes)
+{
+    const KeyPolicy POLICIES[] = {KEY_TITLE, KEY_TITLE_ISBN};
+    const char *const POLICY_NAMES[] = {"folded-title", "folded-title+isbn"};
+    string KEY_POLICY;
+    bool first = true;
+    auto report = [&](const string &backend, size_t records, const string &op, size_t ops, double seconds)
+    {
+        cout << (first ? "\n" : ",\n") << "    {\"backend\": \"" << backend << "\", \"key_policy\": \"" << KEY_POLICY
+             << "\", \"records\": " << records << ", \"op\": \"" << op << "\", \"ops\": " << ops
+             << ", \"seconds\": " << seconds << ", \"ns_per_op\": " << (ops ? seconds * 1e9 / ops : 0) << "}";
+        first = false;
+    };
+    auto reportMemory = [&](const string &backend, size_t records, size_t bytes)
+    {
+        cout << (first ? "\n" : ",\n") << "    {\"backend\": \"" << backend << "\", \"key_policy\": \"" << KEY_POLICY
+             << "\", \"records\": " << records << ", \"op\": \"memory\", \"bytes\": " << bytes << "}";
+        first = false;
+    };
+    auto timed = [](auto &&work)
+    {
+        auto start = chrono::steady_clock::now();
+        work();
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+
+    cout << "{\n  \"benchmark\": \"catalog\",\n  \"results\": [";
+    for (size_t run = 0; run < 2 * sizes.size(); run++)
+    {
+        KeyPolicy keys = POLICIES[run / sizes.size()];
+        size_t n = sizes[run % sizes.size()];
+        KEY_POLICY = POLICY_NAMES[keys];
+        BookGenerator generator(42);
+        vector<Book> books = generator.generate(n, keys);
+        vector<Book> extra = BookGenerator(7).generate(min<size_t>(n, 10000), keys);
+        size_t queries = min<size_t>(n, 100000);
+        vector<string> titles, prefixes;
+        for (size_t i = 0; i < queries; i++)
+            titles.push_back(books[(i * 2654435761u) % n].title);
+        for (size_t i = 0; i < 1000; i++)
+        {
+            const string &title = books[(i * 40503u) % n].title;
+            prefixes.push_back(title.substr(0, title.find(' ') == string::npos ? title.size() : title.find(' ') + 2));
+        }
+        const vector<string> keywords = {"physics", "calculus", "wiley", "spiegel", "1999"};
+
+        auto readOps = [&](const string &backend, const Catalog &cat)
+        {
+            size_t hits = 0;
+            report(backend, n, "exact_lookup", queries, timed([&]
+                                                              { for (const string &t : titles) hits += catalogContains(cat, t); }));
+            report(backend, n, "equal_range", queries, timed([&]
+                                                             {
+                for (const string &t : titles)
+                    catalogEqualRange(cat, t, [&](const Book &) { hits++; }); }));
+            report(backend, n, "prefix_query", prefixes.size(), timed([&]
+                                                                      {
+                for (const string &p : prefixes)
+                {
+                    catalogPrefix(cat, p, [&](const Book &) { hits++; });
+                } }));
+            report(backend, n, "keyword_search", keywords.size(), timed([&]
+                                                                        {
+                for (const string &k : keywords)
+                    catalogForEach(cat, [&](const Book &b) { hits += bookMatches(b, k); }); }));
+            report(backend, n, "full_traversal", n, timed([&]
+                                                          { catalogForEach(cat, [&](const Book &) { hits++; }); }));
+            if (!hits)
+                cerr << "warning: benchmark queries found nothing" << endl;
+        };
+        auto writeOps = [&](const string &backend, Catalog &cat)
+        {
+            report(backend, n, "insert", extra.size(), timed([&]
+                                                             { for (const Book &b : extra) catalogAdd(cat, b); }));
+            report(backend, n, "delete", queries, timed([&]
+                                                        { for (const string &t : titles) catalogRemove(cat, t); }));
+        };
+
+        // Runtime AVL tree
+        {
+            Catalog cat;
+            cat.keys = keys;
+            size_t before = heapInUse();
+            report("avl", n, "build_by_insert", n, timed([&]
+                                                         { for (const Book &b : books) cat.root = insert(cat.root, b, keys); }));
+            reportMemory("avl", n, heapInUse() - before);
+            freeTree(cat.root);
+            cat.root = nullptr;
+
+            vector<Book> copy = books;
+            report("avl", n, "bulk_load", n, timed([&]
+                                                   {
+                stable_sort(copy.begin(), copy.end(), [&](const Book &a, const Book &b)
+                            { return compareKeys(a.title, a.isbn, b.title, b.isbn, keys) < 0; });
+                bulkLoad(cat, copy); }));
+            readOps("avl", cat);
+            string path = "/tmp/catalog-bench-" + to_string(getpid()) + ".snap";
+            saveSnapshot(cat, path);
+            writeOps("avl", cat);
+            freeTree(cat.root);
+
+            // The same catalog mapped from a snapshot
+            Catalog mapped;
+            Snapshot snap;
+            report("snapshot", n, "open", 1, timed([&]
+                                                   { openSnapshot(path, snap, false); }));
+            mapped.base = &snap.layer;
+            mapped.keys = snap.layer.keys;
+            reportMemory("snapshot", n, snap.size);
+            readOps("snapshot", mapped);
+            writeOps("snapshot", mapped);
+            freeTree(mapped.root);
+            closeSnapshot(snap);
+            remove(path.c_str());
+        }
+    }
+    cout << "\n  ]\n}" << endl;
+}
+
+// Consistency checks run by --self-test; returns the number of failures.
+// Ranked search is checked on the seed catalog and on a generated one with
+// books removed, so stale postings are in play too.
+int runSelfTest()
+{
+    int failures = 0;
+    {
+        Catalog seed;
+        seed.base = &seedLayer;
+        failures += checkRanking(seed, {"the calculus", "calculus physics", "theory of mechanics",
+                                        "schaum outline physics", "introduction to data structures"});
+        dropIndex(seed);
+    }
+    {
+        Catalog cat;
+        vector<Book> books = BookGenerator(11).generate(5000);
+        stable_sort(books.begin(), books.end(), [](const Book &a, const Book &b)
+                    { return compareTitles(a.title, b.title) < 0; });
+        bulkLoad(cat, books);
+        buildIndex(cat);
+        vector<string> gone;
+        catalogForEach(cat, [&](const Book &book) {
+            if (gone.size() < 500 && book.title.size() % 3 == 0)
+                gone.push_back(book.title);
+        });
+        for (const string &title : gone)
+            catalogRemove(cat, title);
+        failures += checkRanking(cat, {"quantum mechanics", "physics calculus theory", "modern data algorithms",
+                                       "introduction advanced", "heat transfer fluid dynamics"});
+        dropIndex(cat);
+        freeTree(cat.root);
+    }
+    cout << (failures ? "self-test failed: " + to_string(failures) + " failure(s)" : "self-test passed") << endl;
+    return failures;
+}
+
+// A batch count argument: decimal digits only, and small enough for size_t
+bool parseCount(const string &text, size_t &count)
+{
+    if (text.empty() || !isdigit((unsigned char)text[0]))
+        return false;
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (*end || errno == ERANGE || value > SIZE_MAX)
+        return false;
+    count = value;
+    return true;
+}
+
+// Batch mode: one tab-separated command per line, results as JSON lines on
+// stdout. Commands:
+//   add<TAB>title<TAB>author<TAB>publisher<TAB>month<TAB>day<TAB>year<TAB>isbn<TAB>category<TAB>callNumber
+//   remove<TAB>title[<TAB>isbn]     find<TAB>title[<TAB>isbn]     search<TAB>keyword
+//   prefix<TAB>prefix    query<TAB>query-language text    list
+//   rank<TAB>k<TAB>words     fuzzy<TAB>word[<TAB>max edits, 0 to 2]
+//   complete<TAB>n<TAB>prefix[<TAB>title]
+// In a catalog keyed by title and ISBN (--editions) the isbn picks one
+// edition; without it find lists and remove drops every edition of title.
+// find, search, prefix, query and list print the matching books first, in title
+// order, in the JSONL export format; rank prints the k best books by BM25,
+// best first, and puts their scores in the status line. fuzzy and complete
+// print no books, only the terms near word or the completions of prefix
+// (most popular first, or alphabetical with "title") in their status line.
+// search and query go through a session, so a search that narrows the one
+// before filters its results. Every command then ends with one
+// status line {"op":...,"ok":...,"count":...}. Blank lines and lines
+// starting with # are skipped. A final {"op":"done",...} line sums up.
+int runBatch(Catalog &cat, istream &in)
+{
+    ExportWriter out(STDOUT_FILENO, EXPORT_JSONL);
+    SearchSession session;
+    vector<string> args;
+    size_t commands = 0, errors = 0, lineNumber = 0;
+    auto start = chrono::steady_clock::now();
+    for (string line; getline(in, line);)
+    {
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+        args.clear();
+        for (size_t at = 0;; at++)
+        {
+            size_t tab = line.find('\t', at);
+            args.push_back(line.substr(at, tab - at));
+            if (tab == string::npos)
+                break;
+            at = tab;
+        }
+        const string &op = args[0];
+        bool ok = true;
+        size_t count = 0, k;
+        auto emit = [&](const Book &book) {
+            out.add(book);
+            count++;
+        };
+        if (op == "add" && args.size() >= 2 && args.size() <= FIELD_COUNT + 1 && !args[1].empty())
+        {
+            Book book;
+            for (size_t f = 1; f < args.size(); f++)
+                book.*bookFields[f - 1] = std::move(args[f]);
+            ok = catalogAdd(cat, book);
+            count = ok;
+        }
+        else if (op == "remove" && (args.size() == 2 || args.size() == 3))
+            count = ok = catalogRemove(cat, args[1], args.size() == 3 ? &args[2] : nullptr);
+        else if (op == "find" && cat.keys == KEY_TITLE_ISBN && args.size() == 2)
+        {
+            LatencyTimer timer(OP_FIND, &args[1]);
+            catalogEqualRange(cat, args[1], emit);
+            ok = count > 0;
+        }
+        else if (op == "find" && (args.size() == 2 || args.size() == 3))
+            ok = catalogLookup(cat, args[1], emit, args.size() == 3 ? &args[2] : nullptr);
+        else if (op == "search" && args.size() == 2)
+        {
+            vector<Book> found;
+            sessionSearch(cat, session, args[1], found);
+            for (const Book &book : found)
+                emit(book);
+        }
+        else if (op == "prefix" && args.size() == 2)
+            catalogPrefix(cat, args[1], emit);
+        else if (op == "list" && args.size() == 1)
+        {
+            LatencyTimer timer(OP_TRAVERSE);
+            catalogForEach(cat, emit);
+        }
+        else if (op == "rank" && args.size() == 3 && parseCount(args[1], k))
+        {
+            vector<pair<float, Book>> found;
+            rankedSearch(cat, args[2], k, found);
+            string scores;
+            for (const pair<float, Book> &hit : found)
+            {
+                emit(hit.second);
+                scores += (scores.empty() ? "" : ",") + to_string(hit.first);
+            }
+            commands++;
+            out.addRaw("{\"op\":\"rank\",\"ok\":true,\"count\":" + to_string(count) + ",\"scores\":[" + scores +
+                       "]}\n");
+            continue;
+        }
+        else if (op == "complete" && (args.size() == 3 || (args.size() == 4 && args[3] == "title")) &&
+                 parseCount(args[1], k))
+        {
+            vector<Completion> completions;
+            autocomplete(cat, args[2], k, args.size() == 4 ? BY_TITLE : BY_POPULARITY, completions);
+            commands++;
+            out.addRaw("{\"op\":\"complete\",\"ok\":true,\"count\":" + to_string(completions.size()) +
+                       ",\"completions\":[");
+            for (size_t i = 0; i < completions.size(); i++)
+            {
+                out.addRaw(i ? ",{\"text\":" : "{\"text\":");
+                out.addJson(completions[i].text);
+                out.addRaw(string(",\"kind\":\"") + (completions[i].author ? "author" : "title") +
+                           "\",\"books\":" + to_string(completions[i].books) + "}");
+            }
+            out.addRaw("]}\n");
+            continue;
+        }
+        else if (op == "fuzzy" && (args.size() == 2 ||
+                                    (args.size() == 3 && parseCount(args[2], k) && k <= MAX_FUZZY_EDITS)))
+        {
+            size_t length = 0;
+            for (size_t i = 0; i < args[1].size(); length++)
+                nextCodePoint(args[1], i);
+            vector<FuzzyMatch> matches;
+            fuzzyLookup(cat, args[1], args.size() == 3 ? (int)k : fuzzyEdits(length), matches);
+            // Folded terms are letters and digits only, so they need no escaping
+            string terms;
+            for (const FuzzyMatch &match : matches)
+                terms += string(terms.empty() ? "" : ",") + "{\"term\":\"" + *match.term + "\",\"distance\":" +
+                         to_string(match.distance) + ",\"books\":" + to_string(match.docs) + "}";
+            commands++;
+            out.addRaw("{\"op\":\"fuzzy\",\"ok\":true,\"count\":" + to_string(matches.size()) + ",\"terms\":[" +
+                       terms + "]}\n");
+            continue;
+        }
+        else if (op == "query" && args.size() == 2)
+        {
+            // The status line also carries the plan, with estimated and actual rows
+            vector<Book> found;
+            QueryPlan plan;
+            string error;
+            ok = runQuery(cat, args[1], found, plan, error, &session);
+            for (const Book &book : found)
+                emit(book);
+            string steps;
+            for (const QueryStep &step : plan.steps)
+                steps += string(steps.empty() ? "" : ",") + "{\"step\":\"" + step.action + "\",\"estimated\":" +
+                         to_string(step.estimated) + ",\"actual\":" + to_string(step.actual) + "}";
+            commands++;
+            out.addRaw("{\"op\":\"query\",\"ok\":" + string(ok ? "true" : "false") + ",\"count\":" +
+                       to_string(count) + ",\"estimated\":" + to_string(plan.estimatedRows) + ",\"plan\":[" +
+                       steps + "]}\n");
+            continue;
+        }
+        else
+        {
+            errors++;
+            out.addRaw("{\"op\":\"error\",\"ok\":false,\"line\":" + to_string(lineNumber) + "}\n");
+            continue;
+        }
+        commands++;
+        out.addRaw("{\"op\":\"" + op + "\",\"ok\":" + (ok ? "true" : "false") + ",\"count\":" +
+                   to_string(count) + "}\n");
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    out.addRaw("{\"op\":\"done\",\"commands\":" + to_string(commands) + ",\"errors\":" + to_string(errors) +
+               ",\"seconds\":" + to_string(seconds) + "}\n");
+    return out.flush() && errors == 0 ? 0 : 1;
+}
+
+struct WorkloadOp
+{
+    LatencyOp op;
+    int64_t start;     // ns since recording began
+    uint64_t duration; // ns as recorded
+    Book book;         // add: the book; otherwise the argument is in title
+};
+
+bool loadWorkload(const string &path, vector<WorkloadOp> &ops)
+{
+    ifstream file(path, ios::binary);
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (data.size() < sizeof(WORKLOAD_MAGIC) || memcmp(data.data(), WORKLOAD_MAGIC, sizeof(WORKLOAD_MAGIC)) != 0)
+        return false;
+    const char *p = data.data() + sizeof(WORKLOAD_MAGIC), *end = data.data() + data.size();
+    int64_t at = 0;
+    while (p < end)
+    {
+        WorkloadOp op;
+        uint64_t delta, length;
+        op.op = (LatencyOp)(unsigned char)*p++;
+        if (op.op >= LATENCY_OP_COUNT || !getVarint(p, end, delta) || !getVarint(p, end, op.duration))
+            return false;
+        at += (int64_t)(delta >> 1) ^ -(int64_t)(delta & 1);
+        op.start = at;
+        int strings = op.op == OP_ADD ? FIELD_COUNT : op.op == OP_TRAVERSE ? 0 : 1;
+        for (int f = 0; f < strings; f++)
+        {
+            if (!getVarint(p, end, length) || length > (uint64_t)(end - p))
+                return false;
+            (op.book.*bookFields[f]).assign(p, length);
+            p += length;
+        }
+        ops.push_back(std::move(op));
+    }
+    // Records are written as operations finish; replay them in start order
+    stable_sort(ops.begin(), ops.end(), [](const WorkloadOp &a, const WorkloadOp &b) { return a.start < b.start; });
+    return true;
+}
+
+// Replays a recorded workload against cat, back to back or, when paced, at
+// the recorded start times. Prints one JSON object with the throughput and,
+// per operation type, the recorded and replayed latency percentiles.
+int runReplay(Catalog &cat, const string &path, bool paced)
+{
+    vector<WorkloadOp> ops;
+    if (!loadWorkload(path, ops))
+    {
+        cout << "Error: " << path << " is not a valid workload trace." << endl;
+        return 1;
+    }
+    vector<vector<uint64_t>> recorded(LATENCY_OP_COUNT);
+    for (const WorkloadOp &op : ops)
+        recorded[op.op].push_back(op.duration);
+
+    resetLatencies();
+    size_t results = 0;
+    auto start = chrono::steady_clock::now();
+    for (const WorkloadOp &op : ops)
+    {
+        if (paced)
+            this_thread::sleep_until(start + chrono::nanoseconds(op.start - ops.front().start));
+        switch (op.op)
+        {
+        case OP_ADD:
+            results += catalogAdd(cat, op.book);
+            break;
+        case OP_REMOVE:
+        case OP_FIND:
+        {
+            // Recorded as the title, or "isbn<TAB>title" for one edition; a
+            // find without one lists every edition, as the batch does
+            size_t tab = op.book.title.find('\t');
+            string isbn = tab == string::npos ? "" : op.book.title.substr(0, tab);
+            string title = tab == string::npos ? op.book.title : op.book.title.substr(tab + 1);
+            const string *edition = tab == string::npos ? nullptr : &isbn;
+            if (op.op == OP_REMOVE)
+                results += catalogRemove(cat, title, edition);
+            else if (!edition && cat.keys == KEY_TITLE_ISBN)
+                catalogEqualRange(cat, title, [&](const Book &) { results++; });
+            else
+                results += catalogContains(cat, title, edition);
+            break;
+        }
+        case OP_PREFIX:
+            catalogPrefix(cat, op.book.title, [&](const Book &) { results++; });
+            break;
+        case OP_KEYWORD:
+            catalogSearch(cat, op.book.title, [&](const Book &) { results++; });
+            break;
+        case OP_QUERY:
+        {
+            vector<Book> found;
+            QueryPlan plan;
+            string error;
+            runQuery(cat, op.book.title, found, plan, error);
+            results += found.size();
+            break;
+        }
+        case OP_RANKED:
+        {
+            // Recorded as "k<TAB>text"
+            vector<pair<float, Book>> found;
+            size_t tab = op.book.title.find('\t');
+            rankedSearch(cat, op.book.title.substr(tab + 1), strtoul(op.book.title.c_str(), nullptr, 10), found);
+            results += found.size();
+            break;
+        }
+        case OP_FUZZY:
+        {
+            // Recorded as "maxEdits<TAB>word"
+            vector<FuzzyMatch> matches;
+            size_t tab = op.book.title.find('\t');
+            long maxEdits = strtol(op.book.title.c_str(), nullptr, 10);
+            fuzzyLookup(cat, op.book.title.substr(tab + 1), (int)clamp(maxEdits, 0L, (long)MAX_FUZZY_EDITS), matches);
+            results += matches.size();
+            break;
+        }
+        case OP_COMPLETE:
+        {
+            // Recorded as "limit<TAB>order<TAB>prefix"
+            vector<Completion> completions;
+            size_t tab = op.book.title.find('\t'), second = op.book.title.find('\t', tab + 1);
+            CompletionOrder order = op.book.title.compare(tab + 1, second - tab - 1, "title") ? BY_POPULARITY : BY_TITLE;
+            autocomplete(cat, op.book.title.substr(second + 1), strtoul(op.book.title.c_str(), nullptr, 10), order,
+                         completions);
+            results += completions.size();
+            break;
+        }
+        case OP_IMPORT:
+        {
+            // Recorded as the path of the file, which is read again
+            ImportResult imported;
+            importBooks(cat, op.book.title, imported);
+            results += imported.added;
+            break;
+        }
+        default:
+        {
+            LatencyTimer timer(OP_TRAVERSE);
+            catalogForEach(cat, [&](const Book &) { results++; });
+        }
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    auto percentile = [](vector<uint64_t> &values, double q) {
+        size_t at = min(values.size() - 1, (size_t)(q * values.size()));
+        nth_element(values.begin(), values.begin() + at, values.end());
+        return values[at];
+    };
+    cout << "{\"trace\":\"" << path << "\",\"paced\":" << (paced ? "true" : "false") << ",\"ops\":" << ops.size()
+         << ",\"results\":" << results << ",\"seconds\":" << seconds
+         << ",\"ops_per_sec\":" << (seconds > 0 ? ops.size() / seconds : 0) << ",\"operations\":[";
+    bool first = true;
+    for (int op = 0; op < LATENCY_OP_COUNT; op++)
     {
-        menu(root);
-        cout << endl;
+        if (recorded[op].empty())
+            continue;
+        LatencySummary s = latencySummary((LatencyOp)op);
+        cout << (first ? "" : ",") << "\n  {\"op\":\"" << latencyOpNames[op] << "\",\"count\":" << recorded[op].size()
+             << ",\"recorded_p50_ns\":" << percentile(recorded[op], 0.50)
+             << ",\"recorded_p99_ns\":" << percentile(recorded[op], 0.99) << ",\"p50_ns\":" << s.p50
+             << ",\"p90_ns\":" << s.p90 << ",\"p99_ns\":" << s.p99 << ",\"p999_ns\":" << s.p999
+             << ",\"max_ns\":" << s.max << "}";
+        first = false;
     }
+    cout << "\n]}" << endl;
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    string catalogPath, tracePath, batchPath, recordPath, replayPath;
+    bool verify = false, batch = false, paced = false, empty = false, editions = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--catalog" && i + 1 < argc)
+            catalogPath = argv[++i];
+        else if (arg == "--verify")
+            verify = true;
+        else if (arg == "--trace" && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (arg == "--record" && i + 1 < argc)
+            recordPath = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc)
+            replayPath = argv[++i];
+        else if (arg == "--paced")
+            paced = true;
+        else if (arg == "--empty")
+            empty = true;
+        else if (arg == "--editions")
+            editions = true;
+        else if (arg == "--batch")
+        {
+            // --batch [FILE]: commands from FILE, or stdin when omitted
+            batch = true;
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+                batchPath = argv[++i];
+        }
+        else if (arg == "--bench")
+        {
+            // --bench [N,N,...]: catalog sizes, default 10^3 to 10^5
+            vector<size_t> sizes;
+            string list = i + 1 < argc ? argv[i + 1] : "";
+            if (!list.empty() && isdigit((unsigned char)list[0]))
+                i++;
+            else
+                list = "1000,10000,100000";
+            stringstream items(list);
+            for (string item; getline(items, item, ',');)
+                sizes.push_back(stoul(item));
+            runBenchmark(sizes);
+            return 0;
+        }
+        else if (arg == "--self-test")
+            return runSelfTest() ? 1 : 0;
+        else
+        {
+            cout << "Usage: " << argv[0] << " [--catalog FILE [--verify] | --empty] [--editions] [--trace FILE] [--record FILE]"
+                 << " [--batch [FILE] | --replay FILE [--paced] | --bench [N,N,...] | --self-test]" << endl;
+            return 1;
+        }
+    }
+
+    if (!tracePath.empty())
+        startTracing();
+
+    // With --catalog the snapshot is mapped as the base layer; the built-in
+    // seed image is only used when the file does not exist yet and --empty
+    // (a plain AVL tree) was not given.
+    Catalog cat;
+    Snapshot snap;
+    if (!catalogPath.empty() && access(catalogPath.c_str(), F_OK) == 0)
+    {
+        if (!openSnapshot(catalogPath, snap, verify))
+            return 1;
+        cat.base = &snap.layer;
+    }
+    if (!cat.base && !empty)
+        cat.base = &seedLayer;
+    // --editions keys books on title and ISBN, so editions sharing a title
+    // coexist. A title-keyed base is sorted by that key too (its titles are
+    // unique), but a catalog saved with --editions always keeps it.
+    if (editions || (cat.base && cat.base->keys == KEY_TITLE_ISBN))
+        cat.keys = KEY_TITLE_ISBN;
+    if (!recordPath.empty() && !startRecording(recordPath))
+    {
+        cout << "Error: could not create " << recordPath << "." << endl;
+        return 1;
+    }
+
+    // A replay is an experiment: the catalog file is left as it was
+    int status = 0;
+    if (!replayPath.empty())
+    {
+        status = runReplay(cat, replayPath, paced);
+        catalogPath.clear();
+    }
+    else if (batch)
+    {
+        ifstream file;
+        if (!batchPath.empty())
+        {
+            file.open(batchPath);
+            if (!file)
+            {
+                cout << "Error: could not open " << batchPath << "." << endl;
+                return 1;
+            }
+        }
+        else
+            ios::sync_with_stdio(false);
+        status = runBatch(cat, batchPath.empty() ? cin : file);
+    }
+    else
+    {
+        titleScreen();
+        SearchSession session;
+        while (menu(cat, session))
+            cout << endl;
+    }
+
+    bool saved = catalogPath.empty() || saveSnapshot(cat, catalogPath);
+    if (!recordPath.empty() && !stopRecording())
+        cout << "Error: could not write " << recordPath << "." << endl;
+    if (!tracePath.empty() && !writeTrace(tracePath))
+        cout << "Error: could not write " << tracePath << "." << endl;
+    dropIndex(cat);
+    dropCompletions(cat);
+    delete cat.queries;
+    freeTree(cat.root);
+    closeSnapshot(snap);
+    return saved ? status : 1;
+}
@@ -2,17 +2,68 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <unordered_map>
+#include <array>
 #include <iomanip>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 using namespace std;
 
+enum ItemStatus : uint8_t
+{
+    ITEM_AVAILABLE,
+    ITEM_ON_LOAN,
+    ITEM_WITHDRAWN // missing, in repair and the like
+};
+
+// One physical copy of a title
+struct Item
+{
+    uint32_t copy;   // unique across the catalog, never 0
+    uint16_t branch; // index into the library's branch names
+    ItemStatus status;
+    string callNumber;
+};
+
+// The copies a title has, if any, and how many are available at each branch
+struct Holdings
+{
+    vector<Item> items;
+    vector<uint16_t> availableAt; // by branch, kept up to date as copies change status
+    uint32_t available = 0;
+};
+
 // what the hik
 struct Book
 {
     string title, author;
     int year;
     string isbn;
-    bool available;
+    bool available; // for a title with copies, whether any copy is
+    Holdings holdings;
 
     Book(string t, string a, int y, string i = "", bool av = true)
         : title(t), author(a), year(y), isbn(i), available(av) {}
@@ -28,11 +79,695 @@ struct Node
     Node(Book b) : book(b), height(1), left(nullptr), right(nullptr) {}
 };
 
+uint32_t crc32(const void *data, size_t size, uint32_t crc = 0)
+{
+    static const array<uint32_t, 256> table = []
+    {
+        array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Binary encoding shared by log records and checkpoints (host byte order)
+void putU32(string &out, uint32_t value)
+{
+    out.append((const char *)&value, sizeof(value));
+}
+
+void putU64(string &out, uint64_t value)
+{
+    out.append((const char *)&value, sizeof(value));
+}
+
+void putString(string &out, const string &value)
+{
+    putU32(out, value.size());
+    out += value;
+}
+
+void putBook(string &out, const Book &book)
+{
+    putString(out, book.title);
+    putString(out, book.author);
+    putU32(out, (uint32_t)book.year);
+    putString(out, book.isbn);
+    out += (char)book.available;
+}
+
+bool getU32(const char *&p, const char *end, uint32_t &value)
+{
+    if (end - p < (ptrdiff_t)sizeof(value))
+        return false;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+bool getU64(const char *&p, const char *end, uint64_t &value)
+{
+    if (end - p < (ptrdiff_t)sizeof(value))
+        return false;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+bool getString(const char *&p, const char *end, string &value)
+{
+    uint32_t size;
+    if (!getU32(p, end, size) || (size_t)(end - p) < size)
+        return false;
+    value.assign(p, size);
+    p += size;
+    return true;
+}
+
+bool getBook(const char *&p, const char *end, Book &book)
+{
+    uint32_t year;
+    if (!getString(p, end, book.title) || !getString(p, end, book.author) ||
+        !getU32(p, end, year) || !getString(p, end, book.isbn) || p == end)
+        return false;
+    book.year = (int)year;
+    book.available = *p++ != 0;
+    return true;
+}
+
+bool readFile(const string &path, string &contents)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+        return false;
+    contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    return true;
+}
+
+// The last byte is the format version: version 1 had no loans section,
+// version 2 no holds section and version 3 no copies
+const char CHECKPOINT_MAGIC[8] = {'A', 'V', 'L', 'L', 'I', 'B', '\0', '\4'};
+
+enum WalRecordType : uint8_t
+{
+    WAL_ADD = 1,
+    WAL_REMOVE = 2,
+    WAL_UPDATE = 3,
+    WAL_TOGGLE = 4,       // title and the availability it was set to
+    WAL_CHECKOUT = 5,
+    WAL_RETURN = 6,
+    WAL_HOLD = 7,
+    WAL_CANCEL_HOLD = 8,
+    WAL_DISPATCH = 9,     // a book that became available went to its next hold
+    WAL_EXPIRE_HOLDS = 10,
+    WAL_ADD_COPY = 11,
+    WAL_REMOVE_COPY = 12,
+    WAL_COPY_STATUS = 13
+};
+
+// Append-only write-ahead log with group commit. Writers append encoded
+// records to a shared buffer and wait for their sequence number to become
+// durable; a flusher thread writes whole groups and issues one fdatasync per
+// group, either when groupSize records are pending or after groupWindow.
+// Each record is framed as [u32 payload length][u32 CRC of type+payload][u8 type][payload].
+class WriteAheadLog
+{
+private:
+    int fd;
+    size_t groupSize;
+    chrono::microseconds groupWindow;
+    mutex lock;
+    condition_variable wakeFlusher, durable;
+    string pending, writing;
+    size_t pendingRecords;
+    uint64_t appendedLsn, durableLsn;
+    bool stopping, failed;
+    thread flusher;
+    function<void()> onDurable; // called, under lock, each time a group is on disk
+
+    void flushLoop()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true)
+        {
+            wakeFlusher.wait(guard, [&] { return stopping || pendingRecords > 0; });
+            if (pendingRecords == 0)
+                break;
+            wakeFlusher.wait_for(guard, groupWindow, [&] { return stopping || pendingRecords >= groupSize; });
+
+            writing.clear();
+            writing.swap(pending);
+            pendingRecords = 0;
+            uint64_t lsn = appendedLsn;
+            guard.unlock();
+
+            bool ok = true;
+            for (size_t done = 0; ok && done < writing.size();)
+            {
+                ssize_t n = write(fd, writing.data() + done, writing.size() - done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                ok = n > 0;
+                done += ok ? n : 0;
+            }
+            ok = ok && fdatasync(fd) == 0;
+
+            guard.lock();
+            failed = failed || !ok;
+            durableLsn = lsn;
+            durable.notify_all();
+            if (onDurable)
+                onDurable();
+        }
+    }
+
+public:
+    WriteAheadLog() : fd(-1), groupSize(1), groupWindow(0), pendingRecords(0),
+                      appendedLsn(0), durableLsn(0), stopping(false), failed(false) {}
+
+    ~WriteAheadLog()
+    {
+        close();
+    }
+
+    bool isOpen() const
+    {
+        return fd >= 0;
+    }
+
+    bool open(const string &path, size_t batch, chrono::microseconds window)
+    {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+            return false;
+        groupSize = batch ? batch : 1;
+        groupWindow = window;
+        stopping = failed = false;
+        flusher = thread(&WriteAheadLog::flushLoop, this);
+        return true;
+    }
+
+    void close()
+    {
+        if (fd < 0)
+            return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wakeFlusher.notify_one();
+        flusher.join();
+        ::close(fd);
+        fd = -1;
+    }
+
+    // Queues a record and returns its sequence number without waiting
+    uint64_t append(uint8_t type, const string &payload)
+    {
+        uint32_t crc = crc32(&type, 1);
+        crc = crc32(payload.data(), payload.size(), crc);
+        lock_guard<mutex> guard(lock);
+        putU32(pending, payload.size());
+        putU32(pending, crc);
+        pending += (char)type;
+        pending += payload;
+        if (++pendingRecords == 1 || pendingRecords >= groupSize)
+            wakeFlusher.notify_one();
+        return ++appendedLsn;
+    }
+
+    // Blocks until every record up to lsn is on disk; false if a write failed
+    bool waitDurable(uint64_t lsn)
+    {
+        unique_lock<mutex> guard(lock);
+        durable.wait(guard, [&] { return durableLsn >= lsn; });
+        return !failed;
+    }
+
+    // Whether every record up to lsn is on disk, without waiting; ok is false
+    // if a write failed
+    bool isDurable(uint64_t lsn, bool &ok)
+    {
+        lock_guard<mutex> guard(lock);
+        ok = !failed;
+        return durableLsn >= lsn;
+    }
+
+    // Sets what the flusher calls after each group; it must not block
+    void setDurableHook(function<void()> hook)
+    {
+        lock_guard<mutex> guard(lock);
+        onDurable = move(hook);
+    }
+
+    // Drops every record once a checkpoint has made them redundant
+    bool truncate()
+    {
+        uint64_t lsn;
+        {
+            lock_guard<mutex> guard(lock);
+            lsn = appendedLsn;
+        }
+        waitDurable(lsn);
+        lock_guard<mutex> guard(lock);
+        return ftruncate(fd, 0) == 0 && fdatasync(fd) == 0;
+    }
+
+    // Calls apply(type, payload, size) for each intact record in the log and
+    // returns the length of the valid prefix; a torn tail ends the replay.
+    template <typename Apply>
+    static size_t replay(const string &path, Apply apply)
+    {
+        string log;
+        if (!readFile(path, log))
+            return 0;
+        const char *begin = log.data(), *p = begin, *end = begin + log.size();
+        while (true)
+        {
+            const char *record = p;
+            uint32_t size, crc;
+            if (!getU32(p, end, size) || !getU32(p, end, crc) || (size_t)(end - p) < size + 1 ||
+                crc32(p, size + 1) != crc)
+                return record - begin;
+            apply((uint8_t)p[0], p + 1, p + 1 + size);
+            p += size + 1;
+        }
+    }
+};
+
+int64_t nowSeconds()
+{
+    return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+const long MAX_PERIOD_DAYS = 3650; // longest loan or hold a request may ask for
+
+// One checked-out book
+struct Loan
+{
+    string title, patron;
+    uint32_t copy;     // 0 for a title without copies
+    int64_t due;       // seconds since the epoch
+    size_t patronSlot; // position in the patron's list of loans
+};
+
+// Loan ids ordered by due date (ties by id) in an AVL tree like the
+// catalog's, so the k loans due first in any window come out in O(log n + k)
+class DueIndex
+{
+private:
+    struct DueNode
+    {
+        int64_t due;
+        uint64_t loan;
+        int height;
+        DueNode *left, *right;
+    };
+    DueNode *root;
+
+    static int height(DueNode *n)
+    {
+        return n ? n->height : 0;
+    }
+
+    static bool before(int64_t due, uint64_t loan, const DueNode *n)
+    {
+        return due != n->due ? due < n->due : loan < n->loan;
+    }
+
+    static DueNode *rotateRight(DueNode *y)
+    {
+        DueNode *x = y->left;
+        y->left = x->right;
+        x->right = y;
+        y->height = 1 + max(height(y->left), height(y->right));
+        x->height = 1 + max(height(x->left), height(x->right));
+        return x;
+    }
+
+    static DueNode *rotateLeft(DueNode *x)
+    {
+        DueNode *y = x->right;
+        x->right = y->left;
+        y->left = x;
+        x->height = 1 + max(height(x->left), height(x->right));
+        y->height = 1 + max(height(y->left), height(y->right));
+        return y;
+    }
+
+    static DueNode *rebalance(DueNode *n)
+    {
+        n->height = 1 + max(height(n->left), height(n->right));
+        int balance = height(n->left) - height(n->right);
+        if (balance > 1)
+        {
+            if (height(n->left->left) < height(n->left->right))
+                n->left = rotateLeft(n->left);
+            return rotateRight(n);
+        }
+        if (balance < -1)
+        {
+            if (height(n->right->right) < height(n->right->left))
+                n->right = rotateRight(n->right);
+            return rotateLeft(n);
+        }
+        return n;
+    }
+
+    static DueNode *insert(DueNode *n, int64_t due, uint64_t loan)
+    {
+        if (!n)
+            return new DueNode{due, loan, 1, nullptr, nullptr};
+        if (before(due, loan, n))
+            n->left = insert(n->left, due, loan);
+        else
+            n->right = insert(n->right, due, loan);
+        return rebalance(n);
+    }
+
+    static DueNode *removeMin(DueNode *n, DueNode *&min)
+    {
+        if (!n->left)
+        {
+            min = n;
+            return n->right;
+        }
+        n->left = removeMin(n->left, min);
+        return rebalance(n);
+    }
+
+    static DueNode *erase(DueNode *n, int64_t due, uint64_t loan)
+    {
+        if (!n)
+            return n;
+        if (due == n->due && loan == n->loan)
+        {
+            DueNode *left = n->left, *right = n->right;
+            delete n;
+            if (!right)
+                return left;
+            right = removeMin(right, n);
+            n->left = left;
+            n->right = right;
+        }
+        else if (before(due, loan, n))
+            n->left = erase(n->left, due, loan);
+        else
+            n->right = erase(n->right, due, loan);
+        return rebalance(n);
+    }
+
+    static void clear(DueNode *n)
+    {
+        if (!n)
+            return;
+        clear(n->left);
+        clear(n->right);
+        delete n;
+    }
+
+public:
+    DueIndex() : root(nullptr) {}
+    DueIndex(const DueIndex &) = delete;
+    DueIndex &operator=(const DueIndex &) = delete;
+    ~DueIndex()
+    {
+        clear(root);
+    }
+
+    void insert(int64_t due, uint64_t loan)
+    {
+        root = insert(root, due, loan);
+    }
+
+    void erase(int64_t due, uint64_t loan)
+    {
+        root = erase(root, due, loan);
+    }
+
+    // Calls visit(loan) for up to limit loans due in [from, until), earliest first
+    template <typename Visit>
+    void visit(int64_t from, int64_t until, size_t limit, Visit visit) const
+    {
+        vector<DueNode *> stack;
+        for (DueNode *n = root; n;)
+            if (n->due >= from)
+            {
+                stack.push_back(n);
+                n = n->left;
+            }
+            else
+                n = n->right;
+        for (size_t count = 0; count < limit && !stack.empty(); count++)
+        {
+            DueNode *n = stack.back();
+            stack.pop_back();
+            if (n->due >= until)
+                return;
+            visit(n->loan);
+            for (n = n->right; n; n = n->left)
+                stack.push_back(n);
+        }
+    }
+};
+
+// A patron waiting for a title
+struct Hold
+{
+    string patron;
+    int64_t expires; // seconds since the epoch; the hold lapses unfilled after this
+};
+
+// Per-title FIFO queues of holds. Entries live in one pool and are linked
+// by index into their title's queue and into a hashed timer wheel of
+// expiry times, so taking the next patron is O(1) and expiring lapsed holds
+// visits only the wheel slots that came due, never every queue. Freed
+// entries are reused.
+class HoldQueues
+{
+private:
+    static const uint32_t NIL = UINT32_MAX;
+    static const size_t WHEEL_SLOTS = 256;
+    static const int64_t WHEEL_TICK = 3600; // seconds per slot
+
+    struct Queue
+    {
+        uint32_t head, tail;
+        size_t count;
+    };
+
+    struct Entry
+    {
+        Hold hold;
+        pair<const string, Queue> *queue; // null while free
+        uint32_t next, prev;              // in the queue; next also links the free list
+        uint32_t wheelNext, wheelPrev, wheelSlot;
+    };
+
+    vector<Entry> pool;
+    uint32_t freeList;
+    unordered_map<string, Queue> queues; // title -> its queue; elements never move
+    array<uint32_t, WHEEL_SLOTS> wheel;
+    int64_t wheelTick; // slots up to this tick have been expired
+    size_t live;
+
+    static int64_t tickOf(int64_t time)
+    {
+        return time >= 0 ? time / WHEEL_TICK : (time + 1) / WHEEL_TICK - 1;
+    }
+
+    static uint32_t slotOf(int64_t tick)
+    {
+        return (uint64_t)tick % WHEEL_SLOTS;
+    }
+
+    void unlink(uint32_t i)
+    {
+        Entry &e = pool[i];
+        Queue &q = e.queue->second;
+        (e.prev == NIL ? q.head : pool[e.prev].next) = e.next;
+        (e.next == NIL ? q.tail : pool[e.next].prev) = e.prev;
+        if (--q.count == 0)
+            queues.erase(queues.find(e.queue->first)); // by key would read the key being destroyed
+        (e.wheelPrev == NIL ? wheel[e.wheelSlot] : pool[e.wheelPrev].wheelNext) = e.wheelNext;
+        if (e.wheelNext != NIL)
+            pool[e.wheelNext].wheelPrev = e.wheelPrev;
+        e.queue = nullptr;
+        e.hold.patron.clear();
+        e.next = freeList;
+        freeList = i;
+        live--;
+    }
+
+public:
+    HoldQueues() : freeList(NIL), wheelTick(INT64_MIN / WHEEL_TICK), live(0)
+    {
+        wheel.fill(NIL);
+    }
+
+    size_t size() const
+    {
+        return live;
+    }
+
+    bool waiting(const string &title) const
+    {
+        return queues.count(title) != 0;
+    }
+
+    // Appends a hold to title's queue; false if the patron is already in it
+    bool place(const string &title, const Hold &hold)
+    {
+        auto it = queues.find(title);
+        if (it != queues.end())
+            for (uint32_t i = it->second.head; i != NIL; i = pool[i].next)
+                if (pool[i].hold.patron == hold.patron)
+                    return false;
+        if (it == queues.end())
+            it = queues.emplace(title, Queue{NIL, NIL, 0}).first;
+        uint32_t i = freeList;
+        if (i == NIL)
+        {
+            i = pool.size();
+            pool.push_back(Entry());
+        }
+        else
+            freeList = pool[i].next;
+        Entry &e = pool[i];
+        Queue &q = it->second;
+        e.hold = hold;
+        e.queue = &*it;
+        e.next = NIL;
+        e.prev = q.tail;
+        (q.tail == NIL ? q.head : pool[q.tail].next) = i;
+        q.tail = i;
+        q.count++;
+        // A hold due in a tick already expired goes in the current tick's
+        // slot, which the next expire visits again
+        e.wheelSlot = slotOf(max(tickOf(hold.expires), wheelTick));
+        uint32_t &head = wheel[e.wheelSlot];
+        e.wheelPrev = NIL;
+        e.wheelNext = head;
+        if (head != NIL)
+            pool[head].wheelPrev = i;
+        head = i;
+        live++;
+        return true;
+    }
+
+    bool cancel(const string &title, const string &patron)
+    {
+        auto it = queues.find(title);
+        if (it != queues.end())
+            for (uint32_t i = it->second.head; i != NIL; i = pool[i].next)
+                if (pool[i].hold.patron == patron)
+                {
+                    unlink(i);
+                    return true;
+                }
+        return false;
+    }
+
+    // Takes the first hold on title still live at now, dropping lapsed ones
+    // ahead of it; false if there is none
+    bool next(const string &title, int64_t now, Hold &hold)
+    {
+        for (auto it = queues.find(title); it != queues.end(); it = queues.find(title))
+        {
+            uint32_t i = it->second.head;
+            bool lapsed = pool[i].hold.expires <= now;
+            if (!lapsed)
+                hold = pool[i].hold;
+            unlink(i);
+            if (!lapsed)
+                return true;
+        }
+        return false;
+    }
+
+    void drop(const string &title)
+    {
+        auto it = queues.find(title);
+        for (size_t n = it == queues.end() ? 0 : it->second.count; n > 0; n--)
+            unlink(it->second.head);
+    }
+
+    // Removes every hold that lapsed by now and returns how many went. Only
+    // the slots of the ticks since the last call are visited, that tick's
+    // included as it may have been partly due; holds further out in those
+    // slots are skipped.
+    size_t expire(int64_t now)
+    {
+        size_t removed = 0;
+        int64_t last = tickOf(now);
+        for (int64_t tick = max(wheelTick, last - (int64_t)WHEEL_SLOTS + 1); tick <= last; tick++)
+            for (uint32_t i = wheel[slotOf(tick)], next; i != NIL; i = next)
+            {
+                next = pool[i].wheelNext;
+                if (pool[i].hold.expires <= now)
+                {
+                    unlink(i);
+                    removed++;
+                }
+            }
+        wheelTick = max(wheelTick, last);
+        return removed;
+    }
+
+    // Calls visit(hold) for title's holds, first in line first
+    template <typename Visit>
+    void visit(const string &title, Visit visit) const
+    {
+        auto it = queues.find(title);
+        if (it != queues.end())
+            for (uint32_t i = it->second.head; i != NIL; i = pool[i].next)
+                visit(pool[i].hold);
+    }
+
+    // Calls visit(title, hold) for every hold, each queue in order
+    template <typename Visit>
+    void visitAll(Visit visit) const
+    {
+        for (const auto &queue : queues)
+            for (uint32_t i = queue.second.head; i != NIL; i = pool[i].next)
+                visit(queue.first, pool[i].hold);
+    }
+};
+
 class LibrarySystem
 {
 private:
     Node *root;
     vector<Book *> searchResults;
+    WriteAheadLog wal;
+    string dataDir;
+    // Readers share the tree; writers hold it exclusively while they log and
+    // apply a change, then release it before waiting for the log to sync
+    mutable shared_mutex treeLock;
+    unordered_map<string, string> isbnIndex; // isbn -> title, for books that have one
+    // Loans by id, indexed by copy (or by title, for titles without copies),
+    // patron and due date
+    unordered_map<uint64_t, Loan> loans;
+    unordered_map<string, uint64_t> loanByTitle;
+    unordered_map<uint32_t, uint64_t> loanByCopy;
+    unordered_map<string, vector<uint64_t>> patronLoans;
+    DueIndex dueIndex;
+    uint64_t nextLoan;
+    HoldQueues holds;
+    static const int64_t HOLD_LOAN_SECONDS = 14 * 86400; // loan period for a filled hold
+    vector<string> branches; // branch names, by the ids items store
+    unordered_map<string, uint16_t> branchIds;
+    uint32_t nextCopy;
 
     // Helper functions for AVL tree
     int height(Node *n)
@@ -114,7 +849,7 @@ private:
         return node;
     }
 
-    Book *searchNode(Node *node, string title)
+    Book *searchNode(Node *node, string title) const
     {
         if (!node)
             return nullptr;
@@ -206,117 +941,1922 @@ private:
             root->right = rightRotate(root->right);
             return leftRotate(root);
         }
-
-        return root;
+
+        return root;
+    }
+
+    void inOrder(Node *root, vector<Book *> &books)
+    {
+        if (!root)
+            return;
+
+        inOrder(root->left, books);
+        books.push_back(&root->book);
+        inOrder(root->right, books);
+    }
+
+    void partialSearch(Node *root, string partialTitle, vector<Book *> &results)
+    {
+        if (!root)
+            return;
+
+        partialSearch(root->left, partialTitle, results);
+
+        string lowerTitle = root->book.title;
+        transform(lowerTitle.begin(), lowerTitle.end(), lowerTitle.begin(), ::tolower);
+
+        string lowerSearch = partialTitle;
+        transform(lowerSearch.begin(), lowerSearch.end(), lowerSearch.begin(), ::tolower);
+
+        if (lowerTitle.find(lowerSearch) != string::npos)
+        {
+            results.push_back(&root->book);
+        }
+
+        partialSearch(root->right, partialTitle, results);
+    }
+
+    void indexBook(const Book &book)
+    {
+        if (!book.isbn.empty())
+            isbnIndex[book.isbn] = book.title;
+    }
+
+    void unindexBook(const Book &book)
+    {
+        auto it = isbnIndex.find(book.isbn);
+        if (it != isbnIndex.end() && it->second == book.title)
+            isbnIndex.erase(it);
+    }
+
+    uint16_t branchId(const string &name)
+    {
+        auto it = branchIds.find(name);
+        if (it != branchIds.end())
+            return it->second;
+        branches.push_back(name);
+        return branchIds[name] = branches.size() - 1;
+    }
+
+    static Item *findItem(Book &book, uint32_t copy)
+    {
+        for (Item &item : book.holdings.items)
+            if (item.copy == copy)
+                return &item;
+        return nullptr;
+    }
+
+    // Moves item to status, keeping the availability counts and the book's flag in step
+    static void setItemStatus(Book &book, Item &item, ItemStatus status)
+    {
+        Holdings &h = book.holdings;
+        if (item.status == ITEM_AVAILABLE)
+        {
+            h.availableAt[item.branch]--;
+            h.available--;
+        }
+        item.status = status;
+        if (status == ITEM_AVAILABLE)
+        {
+            if (h.availableAt.size() <= item.branch)
+                h.availableAt.resize(item.branch + 1);
+            h.availableAt[item.branch]++;
+            h.available++;
+        }
+        book.available = h.available > 0;
+    }
+
+    // Shelves copy of book. A loan of the title itself, from before it had
+    // copies, becomes a loan of this first copy.
+    void addItem(Book &book, uint32_t copy, const string &branch, const string &callNumber, ItemStatus status)
+    {
+        auto lent = book.holdings.items.empty() ? loanByTitle.find(book.title) : loanByTitle.end();
+        if (lent != loanByTitle.end())
+        {
+            loans.at(lent->second).copy = copy;
+            loanByCopy[copy] = lent->second;
+            loanByTitle.erase(lent);
+            status = ITEM_ON_LOAN;
+        }
+        book.holdings.items.push_back(Item{copy, branchId(branch), ITEM_WITHDRAWN, callNumber});
+        setItemStatus(book, book.holdings.items.back(), status);
+        nextCopy = max(nextCopy, copy + 1);
+    }
+
+    void removeItem(Book &book, Item &item)
+    {
+        endLoan(book.title, item.copy);
+        setItemStatus(book, item, ITEM_WITHDRAWN);
+        book.holdings.items.erase(book.holdings.items.begin() + (&item - book.holdings.items.data()));
+    }
+
+    // The loan of copy, or of title when copy is 0
+    uint64_t loanOf(const string &title, uint32_t copy) const
+    {
+        if (copy)
+        {
+            auto it = loanByCopy.find(copy);
+            return it == loanByCopy.end() ? 0 : it->second;
+        }
+        auto it = loanByTitle.find(title);
+        return it == loanByTitle.end() ? 0 : it->second;
+    }
+
+    // Lends copy of book (or book itself when copy is 0) to patron until due
+    void startLoan(Book &book, uint32_t copy, const string &patron, int64_t due)
+    {
+        uint64_t id = nextLoan++;
+        vector<uint64_t> &held = patronLoans[patron];
+        loans.emplace(id, Loan{book.title, patron, copy, due, held.size()});
+        held.push_back(id);
+        dueIndex.insert(due, id);
+        if (copy)
+        {
+            loanByCopy[copy] = id;
+            setItemStatus(book, *findItem(book, copy), ITEM_ON_LOAN);
+        }
+        else
+        {
+            loanByTitle[book.title] = id;
+            book.available = false;
+        }
+    }
+
+    // Drops the loan of copy (or of title when copy is 0), if any, leaving
+    // availability to the caller
+    bool endLoan(const string &title, uint32_t copy = 0)
+    {
+        auto it = loans.find(loanOf(title, copy));
+        if (it == loans.end())
+            return false;
+        Loan &loan = it->second;
+        auto held = patronLoans.find(loan.patron);
+        uint64_t moved = held->second.back();
+        held->second[loan.patronSlot] = moved;
+        loans.at(moved).patronSlot = loan.patronSlot;
+        held->second.pop_back();
+        if (held->second.empty())
+            patronLoans.erase(held);
+        dueIndex.erase(loan.due, it->first);
+        if (copy)
+            loanByCopy.erase(copy);
+        else
+            loanByTitle.erase(title);
+        loans.erase(it);
+        return true;
+    }
+
+    bool lendable(Book &book, uint32_t copy)
+    {
+        if (!copy)
+            return book.holdings.items.empty() && book.available;
+        Item *item = findItem(book, copy);
+        return item && item->status == ITEM_AVAILABLE;
+    }
+
+    // Lends copy of book (or book itself), just made available, to the first
+    // patron still waiting for the title; now is logged so that replay picks
+    // the same patron
+    void applyDispatch(Book &book, uint32_t copy, int64_t now, string *patron)
+    {
+        Hold hold;
+        if (!holds.next(book.title, now, hold))
+            return;
+        startLoan(book, copy, hold.patron, now + HOLD_LOAN_SECONDS);
+        if (patron)
+            *patron = hold.patron;
+    }
+
+    // Returns the log sequence number to wait on, or 0 if nobody was waiting
+    uint64_t dispatchHold(Book &book, uint32_t copy, string *patron = nullptr)
+    {
+        if (!lendable(book, copy) || !holds.waiting(book.title))
+            return 0;
+        int64_t now = nowSeconds();
+        string payload = encodeTitle(book.title);
+        putU64(payload, (uint64_t)now);
+        putU32(payload, copy);
+        uint64_t lsn = logRecord(WAL_DISPATCH, payload);
+        applyDispatch(book, copy, now, patron);
+        return lsn;
+    }
+
+    bool hasLoan(const string &title, const string &patron) const
+    {
+        auto held = patronLoans.find(patron);
+        if (held != patronLoans.end())
+            for (uint64_t id : held->second)
+                if (loans.at(id).title == title)
+                    return true;
+        return false;
+    }
+
+    // Ends every loan on book, copies included
+    void endLoans(Book &book)
+    {
+        endLoan(book.title);
+        for (Item &item : book.holdings.items)
+            endLoan(book.title, item.copy);
+    }
+
+    void clearTree(Node *node)
+    {
+        if (!node)
+            return;
+
+        clearTree(node->left);
+        clearTree(node->right);
+        delete node;
+    }
+
+    // Returns the log sequence number to wait on, or 0 without a data directory
+    uint64_t logRecord(uint8_t type, const string &payload)
+    {
+        return wal.isOpen() ? wal.append(type, payload) : 0;
+    }
+
+    // Where committed() notes sequence numbers instead of waiting, while a
+    // DeferCommits is alive on this thread
+    static inline thread_local uint64_t *deferredLsn = nullptr;
+
+    bool committed(uint64_t lsn)
+    {
+        if (deferredLsn)
+        {
+            *deferredLsn = max(*deferredLsn, lsn);
+            return true;
+        }
+        if (lsn == 0 || wal.waitDurable(lsn))
+            return true;
+        cout << "Error: the change could not be written to the log." << endl;
+        return false;
+    }
+
+    string encodeTitle(const string &title)
+    {
+        string payload;
+        putString(payload, title);
+        return payload;
+    }
+
+    void applyRecord(uint8_t type, const char *p, const char *end)
+    {
+        Book book("", "", 0);
+        string patron, branch;
+        uint64_t due, time;
+        uint32_t copy = 0; // trails the records that can name a copy; absent from older logs
+        uint8_t status;
+        if (type == WAL_ADD && getBook(p, end, book))
+        {
+            if (!searchNode(root, book.title))
+            {
+                root = insertNode(root, book);
+                indexBook(book);
+            }
+        }
+        else if ((type == WAL_UPDATE) && getBook(p, end, book))
+        {
+            Book *current = searchNode(root, book.title);
+            if (current)
+            {
+                unindexBook(*current);
+                current->author = book.author;
+                current->year = book.year;
+                current->isbn = book.isbn;
+                indexBook(*current);
+                if (current->holdings.items.empty())
+                {
+                    current->available = book.available;
+                    if (book.available)
+                        endLoan(book.title);
+                }
+            }
+        }
+        else if (type == WAL_REMOVE && getString(p, end, book.title))
+        {
+            Book *current = searchNode(root, book.title);
+            if (current)
+            {
+                unindexBook(*current);
+                endLoans(*current);
+                holds.drop(book.title);
+                root = deleteNode(root, book.title);
+            }
+        }
+        else if (type == WAL_TOGGLE && getString(p, end, book.title))
+        {
+            Book *current = searchNode(root, book.title);
+            if (current && current->holdings.items.empty())
+            {
+                endLoan(book.title);
+                // Older logs hold only the title, meaning a flip
+                current->available = p < end ? *p != 0 : !current->available;
+            }
+        }
+        else if (type == WAL_CHECKOUT && getString(p, end, book.title) && getString(p, end, patron) &&
+                 getU64(p, end, due))
+        {
+            getU32(p, end, copy);
+            Book *current = searchNode(root, book.title);
+            if (current && lendable(*current, copy))
+                startLoan(*current, copy, patron, (int64_t)due);
+        }
+        else if (type == WAL_RETURN && getString(p, end, book.title))
+        {
+            getU32(p, end, copy);
+            Book *current = searchNode(root, book.title);
+            if (current && endLoan(book.title, copy))
+                returned(*current, copy);
+        }
+        else if (type == WAL_HOLD && getString(p, end, book.title) && getString(p, end, patron) &&
+                 getU64(p, end, time))
+            holds.place(book.title, Hold{patron, (int64_t)time});
+        else if (type == WAL_CANCEL_HOLD && getString(p, end, book.title) && getString(p, end, patron))
+            holds.cancel(book.title, patron);
+        else if (type == WAL_DISPATCH && getString(p, end, book.title) && getU64(p, end, time))
+        {
+            getU32(p, end, copy);
+            Book *current = searchNode(root, book.title);
+            if (current && lendable(*current, copy))
+                applyDispatch(*current, copy, (int64_t)time, nullptr);
+        }
+        else if (type == WAL_EXPIRE_HOLDS && getU64(p, end, time))
+            holds.expire((int64_t)time);
+        else if (type == WAL_ADD_COPY && getString(p, end, book.title) && getU32(p, end, copy) &&
+                 getString(p, end, branch) && getString(p, end, book.isbn))
+        {
+            // A copy the checkpoint already holds was logged before it was taken
+            Book *current = searchNode(root, book.title);
+            if (current && !findItem(*current, copy))
+                addItem(*current, copy, branch, book.isbn, ITEM_AVAILABLE);
+        }
+        else if (type == WAL_REMOVE_COPY && getString(p, end, book.title) && getU32(p, end, copy))
+        {
+            Book *current = searchNode(root, book.title);
+            if (Item *item = current ? findItem(*current, copy) : nullptr)
+                removeItem(*current, *item);
+        }
+        else if (type == WAL_COPY_STATUS && getString(p, end, book.title) && getU32(p, end, copy) && p < end)
+        {
+            status = *p++;
+            Book *current = searchNode(root, book.title);
+            Item *item = current ? findItem(*current, copy) : nullptr;
+            if (item && item->status != ITEM_ON_LOAN)
+                setItemStatus(*current, *item, (ItemStatus)status);
+        }
+    }
+
+    // A copy (or a title without copies) is back from loan
+    static void returned(Book &book, uint32_t copy)
+    {
+        if (copy)
+            setItemStatus(book, *findItem(book, copy), ITEM_AVAILABLE);
+        else
+            book.available = true;
+    }
+
+    static void putLoan(string &out, const Loan &loan)
+    {
+        putString(out, loan.title);
+        putString(out, loan.patron);
+        putU64(out, (uint64_t)loan.due);
+        putU32(out, loan.copy);
+    }
+
+    bool loadCheckpoint(const string &contents)
+    {
+        const char *p = contents.data(), *end = p + contents.size();
+        uint32_t count, crc;
+        if (contents.size() < sizeof(CHECKPOINT_MAGIC) ||
+            memcmp(p, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC) - 1) != 0 || p[7] < 1 || p[7] > CHECKPOINT_MAGIC[7])
+            return false;
+        char version = p[7];
+        p += sizeof(CHECKPOINT_MAGIC);
+        if (!getU32(p, end, count) || !getU32(p, end, crc) || crc32(p, end - p) != crc)
+            return false;
+        Book book("", "", 0);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!getBook(p, end, book))
+                return false;
+            root = insertNode(root, book);
+            indexBook(book);
+        }
+        if (version < 2)
+            return true;
+        string patron, branch;
+        uint32_t items, copy = 0;
+        if (version >= 4)
+        {
+            // nextCopy is kept so numbers of copies since removed are not handed out again
+            if (!getU32(p, end, nextCopy) || !getU32(p, end, count))
+                return false;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (!getString(p, end, book.title) || !getU32(p, end, items))
+                    return false;
+                Book *current = searchNode(root, book.title);
+                for (uint32_t j = 0; j < items; j++)
+                {
+                    if (!getU32(p, end, copy) || !getString(p, end, branch) || p == end)
+                        return false;
+                    ItemStatus status = (ItemStatus)*p++;
+                    if (!getString(p, end, book.isbn))
+                        return false;
+                    // the loans section below puts copies on loan again
+                    if (current)
+                        addItem(*current, copy, branch, book.isbn, status == ITEM_ON_LOAN ? ITEM_AVAILABLE : status);
+                }
+            }
+        }
+        uint64_t due;
+        if (!getU32(p, end, count))
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!getString(p, end, book.title) || !getString(p, end, patron) || !getU64(p, end, due) ||
+                (version >= 4 && !getU32(p, end, copy)))
+                return false;
+            Book *current = searchNode(root, book.title);
+            if (current && (!copy || findItem(*current, copy)))
+                startLoan(*current, copy, patron, (int64_t)due);
+        }
+        if (version < 3)
+            return true;
+        uint64_t expires;
+        if (!getU32(p, end, count))
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!getString(p, end, book.title) || !getString(p, end, patron) || !getU64(p, end, expires))
+                return false;
+            holds.place(book.title, Hold{patron, (int64_t)expires});
+        }
+        return true;
+    }
+
+public:
+    LibrarySystem() : root(nullptr), nextLoan(1), nextCopy(1) {}
+
+    // While one is alive, changes made on this thread return as soon as they
+    // are applied and logged, without waiting for the log to sync; lsn is
+    // raised to the last record they wrote, for the caller to check with
+    // logged(). The server's event loops use this so a slow sync holds up
+    // only the replies that depend on it.
+    struct DeferCommits
+    {
+        explicit DeferCommits(uint64_t &lsn)
+        {
+            deferredLsn = &lsn;
+        }
+        ~DeferCommits()
+        {
+            deferredLsn = nullptr;
+        }
+    };
+
+    // Whether the changes up to lsn are on disk (always, without a data
+    // directory); ok is false if the log write failed
+    bool logged(uint64_t lsn, bool &ok)
+    {
+        ok = true;
+        return lsn == 0 || !wal.isOpen() || wal.isDurable(lsn, ok);
+    }
+
+    // Calls hook, which must not block, whenever more of the log is on disk
+    void onLogged(function<void()> hook)
+    {
+        wal.setDurableHook(move(hook));
+    }
+
+    // Loads the last checkpoint from dir, replays the write-ahead log on top
+    // of it and logs every later change there. groupSize and groupWindow set
+    // how many commits share one fdatasync and how long a group may wait.
+    bool open(const string &dir, size_t groupSize, chrono::microseconds groupWindow)
+    {
+        string contents;
+        if (readFile(dir + "/catalog.snap", contents) && !loadCheckpoint(contents))
+        {
+            cout << "Error: " << dir << "/catalog.snap is corrupt." << endl;
+            return false;
+        }
+        string logPath = dir + "/catalog.wal";
+        size_t valid = WriteAheadLog::replay(logPath, [&](uint8_t type, const char *p, const char *end)
+                                             { applyRecord(type, p, end); });
+        if (::truncate(logPath.c_str(), valid) != 0 && errno != ENOENT)
+            return false;
+        dataDir = dir;
+        return wal.open(logPath, groupSize, groupWindow);
+    }
+
+    // Writes the whole catalog to a new checkpoint and empties the log
+    bool checkpoint()
+    {
+        if (!wal.isOpen())
+            return true;
+        unique_lock<shared_mutex> guard(treeLock);
+        vector<Book *> books;
+        inOrder(root, books);
+        string body;
+        uint32_t withCopies = 0;
+        for (Book *book : books)
+        {
+            putBook(body, *book);
+            withCopies += !book->holdings.items.empty();
+        }
+        putU32(body, nextCopy);
+        putU32(body, withCopies);
+        for (Book *book : books)
+        {
+            if (book->holdings.items.empty())
+                continue;
+            putString(body, book->title);
+            putU32(body, book->holdings.items.size());
+            for (const Item &item : book->holdings.items)
+            {
+                putU32(body, item.copy);
+                putString(body, branches[item.branch]);
+                body += (char)item.status;
+                putString(body, item.callNumber);
+            }
+        }
+        putU32(body, loans.size());
+        dueIndex.visit(INT64_MIN, INT64_MAX, SIZE_MAX, [&](uint64_t id) { putLoan(body, loans.at(id)); });
+        putU32(body, holds.size());
+        holds.visitAll([&](const string &title, const Hold &hold) {
+            putString(body, title);
+            putString(body, hold.patron);
+            putU64(body, (uint64_t)hold.expires);
+        });
+        string contents(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        putU32(contents, books.size());
+        putU32(contents, crc32(body.data(), body.size()));
+        contents += body;
+
+        string path = dataDir + "/catalog.snap", temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && write(fd, contents.data(), contents.size()) == (ssize_t)contents.size() &&
+                  fsync(fd) == 0;
+        if (fd >= 0)
+            close(fd);
+        ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+        int dir = ::open(dataDir.c_str(), O_RDONLY);
+        if (dir >= 0)
+        {
+            fsync(dir);
+            close(dir);
+        }
+        return ok && wal.truncate();
+    }
+
+    ~LibrarySystem()
+    {
+        clearTree(root);
+    }
+
+    // Returns false if the title is already taken or the log write failed
+    bool addBook(string title, string author, int year, string isbn = "", bool available = true)
+    {
+        Book newBook(title, author, year, isbn, available);
+        string payload;
+        putBook(payload, newBook);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            if (searchNode(root, title))
+                return false;
+            lsn = logRecord(WAL_ADD, payload);
+            root = insertNode(root, newBook);
+            indexBook(newBook);
+        }
+        return committed(lsn);
+    }
+
+    bool removeBook(string title)
+    {
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            if (!book)
+                return false;
+
+            lsn = logRecord(WAL_REMOVE, encodeTitle(title));
+            unindexBook(*book);
+            endLoans(*book);
+            holds.drop(title);
+            root = deleteNode(root, title);
+        }
+        return committed(lsn);
+    }
+
+    // Thread-safe lookups for the server; the Book * accessors below are only
+    // safe while no other thread changes the catalog
+    bool copyBook(const string &title, Book &out) const
+    {
+        shared_lock<shared_mutex> guard(treeLock);
+        for (Node *n = root; n; n = title < n->book.title ? n->left : n->right)
+            if (n->book.title == title)
+            {
+                out = n->book;
+                return true;
+            }
+        return false;
+    }
+
+    bool copyBookByIsbn(const string &isbn, Book &out) const
+    {
+        shared_lock<shared_mutex> guard(treeLock);
+        auto it = isbnIndex.find(isbn);
+        if (it == isbnIndex.end())
+            return false;
+        for (Node *n = root; n; n = it->second < n->book.title ? n->left : n->right)
+            if (n->book.title == it->second)
+            {
+                out = n->book;
+                return true;
+            }
+        return false;
+    }
+
+    // Calls visit(book) in title order for up to limit books whose title
+    // starts with prefix (case-sensitive, matching the tree order) and, when
+    // after is given, sorts after it. Returns false once the range is used
+    // up, so a caller can resume from the last title it saw without holding
+    // the lock in between.
+    template <typename Visit>
+    bool visitPrefix(const string &prefix, const string *after, size_t limit, Visit visit) const
+    {
+        shared_lock<shared_mutex> guard(treeLock);
+        vector<Node *> stack;
+        for (Node *n = root; n;)
+            if (after ? n->book.title > *after : n->book.title >= prefix)
+            {
+                stack.push_back(n);
+                n = n->left;
+            }
+            else
+                n = n->right;
+        for (size_t count = 0; !stack.empty(); count++)
+        {
+            if (count == limit)
+                return true;
+            Node *n = stack.back();
+            stack.pop_back();
+            if (n->book.title.compare(0, prefix.size(), prefix) != 0)
+                return false;
+            visit(n->book);
+            for (n = n->right; n; n = n->left)
+                stack.push_back(n);
+        }
+        return false;
+    }
+
+    // Calls visit(book) in title order for each title containing partialTitle
+    // (case-insensitive); an empty partialTitle visits every book
+    template <typename Visit>
+    void visitBooks(const string &partialTitle, Visit visit) const
+    {
+        string lowerSearch = partialTitle, lowerTitle;
+        transform(lowerSearch.begin(), lowerSearch.end(), lowerSearch.begin(), ::tolower);
+        shared_lock<shared_mutex> guard(treeLock);
+        vector<Node *> stack;
+        for (Node *n = root; n || !stack.empty(); n = n->right)
+        {
+            for (; n; n = n->left)
+                stack.push_back(n);
+            n = stack.back();
+            stack.pop_back();
+            if (!lowerSearch.empty())
+            {
+                lowerTitle = n->book.title;
+                transform(lowerTitle.begin(), lowerTitle.end(), lowerTitle.begin(), ::tolower);
+                if (lowerTitle.find(lowerSearch) == string::npos)
+                    continue;
+            }
+            visit(n->book);
+        }
+    }
+
+    Book *findBook(string title)
+    {
+        return searchNode(root, title);
+    }
+
+    vector<Book *> findBooks(string partialTitle)
+    {
+        vector<Book *> results;
+        partialSearch(root, partialTitle, results);
+        return results;
+    }
+
+    vector<Book *> getAllBooks()
+    {
+        vector<Book *> books;
+        inOrder(root, books);
+        return books;
+    }
+
+    // newAvailable is ignored for a title with copies, whose availability
+    // follows its copies
+    bool updateBook(string title, string newAuthor, int newYear, string newIsbn, bool newAvailable)
+    {
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            if (!book)
+                return false;
+
+            unindexBook(*book);
+            book->author = newAuthor;
+            book->year = newYear;
+            book->isbn = newIsbn;
+            indexBook(*book);
+            if (book->holdings.items.empty())
+            {
+                book->available = newAvailable;
+                if (newAvailable)
+                    endLoan(title); // marking a book available checks it back in
+            }
+
+            string payload;
+            putBook(payload, *book);
+            lsn = logRecord(WAL_UPDATE, payload);
+            lsn = max(lsn, dispatchHold(*book, 0));
+        }
+        return committed(lsn);
+    }
+
+    // Returns false for a title with copies; setCopyStatus changes those one copy at a time
+    bool toggleAvailability(string title)
+    {
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            if (!book || !book->holdings.items.empty())
+                return false;
+
+            endLoan(title); // a book on loan is unavailable, so this checks it back in
+            book->available = !book->available;
+            // The new state, not the flip, so replaying over a checkpoint that has it changes nothing
+            string payload = encodeTitle(title);
+            payload += (char)book->available;
+            lsn = logRecord(WAL_TOGGLE, payload);
+            lsn = max(lsn, dispatchHold(*book, 0));
+        }
+        return committed(lsn);
+    }
+
+    // Lends title to patron until due (seconds since the epoch). For a title
+    // with copies an available one is picked, from branch if that is not
+    // empty, and its number goes in copy. Returns false if there is no such
+    // book, nothing is available or the log write failed.
+    bool checkOut(const string &title, const string &patron, int64_t due, const string &branch = "",
+                  uint32_t *copy = nullptr)
+    {
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            if (!book || !book->available)
+                return false;
+            uint32_t lent = 0;
+            if (!book->holdings.items.empty())
+            {
+                auto at = branchIds.find(branch);
+                if (!branch.empty() && at == branchIds.end())
+                    return false;
+                for (const Item &item : book->holdings.items)
+                    if (item.status == ITEM_AVAILABLE && (branch.empty() || item.branch == at->second))
+                    {
+                        lent = item.copy;
+                        break;
+                    }
+                if (!lent)
+                    return false;
+            }
+            string payload;
+            putString(payload, title);
+            putString(payload, patron);
+            putU64(payload, (uint64_t)due);
+            putU32(payload, lent);
+            lsn = logRecord(WAL_CHECKOUT, payload);
+            startLoan(*book, lent, patron, due);
+            if (copy)
+                *copy = lent;
+        }
+        return committed(lsn);
+    }
+
+    // Ends the loan of title, or of one of its copies, and makes it
+    // available, or lends it straight on to the next patron holding the
+    // title, whose name goes in heldFor. Returns false if it was not on loan.
+    bool returnBook(const string &title, uint32_t copy = 0, string *heldFor = nullptr)
+    {
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            if (!book || !loanOf(title, copy) || loans.at(loanOf(title, copy)).title != title)
+                return false;
+            string payload = encodeTitle(title);
+            putU32(payload, copy);
+            lsn = logRecord(WAL_RETURN, payload);
+            endLoan(title, copy);
+            returned(*book, copy);
+            lsn = max(lsn, dispatchHold(*book, copy, heldFor));
+        }
+        return committed(lsn);
+    }
+
+    // Adds a copy of title shelved at branch, available; returns its number,
+    // or 0 if there is no such book or the log write failed
+    uint32_t addCopy(const string &title, const string &branch, const string &callNumber)
+    {
+        uint64_t lsn;
+        uint32_t copy;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            if (!book || branch.empty() || (!branchIds.count(branch) && branches.size() > UINT16_MAX))
+                return 0;
+            copy = nextCopy;
+            string payload = encodeTitle(title);
+            putU32(payload, copy);
+            putString(payload, branch);
+            putString(payload, callNumber);
+            lsn = logRecord(WAL_ADD_COPY, payload);
+            addItem(*book, copy, branch, callNumber, ITEM_AVAILABLE);
+            lsn = max(lsn, dispatchHold(*book, copy));
+        }
+        return committed(lsn) ? copy : 0;
+    }
+
+    // Removes a copy, ending its loan if it was out
+    bool removeCopy(const string &title, uint32_t copy)
+    {
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            Item *item = book ? findItem(*book, copy) : nullptr;
+            if (!item)
+                return false;
+            string payload = encodeTitle(title);
+            putU32(payload, copy);
+            lsn = logRecord(WAL_REMOVE_COPY, payload);
+            removeItem(*book, *item);
+        }
+        return committed(lsn);
+    }
+
+    // Withdraws a copy or puts it back on the shelf. Returns false if there
+    // is no such copy or it is on loan; returnBook brings those back.
+    bool setCopyStatus(const string &title, uint32_t copy, bool available)
+    {
+        ItemStatus status = available ? ITEM_AVAILABLE : ITEM_WITHDRAWN;
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            Item *item = book ? findItem(*book, copy) : nullptr;
+            if (!item || item->status == ITEM_ON_LOAN)
+                return false;
+            string payload = encodeTitle(title);
+            putU32(payload, copy);
+            payload += (char)status;
+            lsn = logRecord(WAL_COPY_STATUS, payload);
+            setItemStatus(*book, *item, status);
+            lsn = max(lsn, dispatchHold(*book, copy));
+        }
+        return committed(lsn);
+    }
+
+    // How many copies of title are available at branch
+    uint32_t availableAt(const string &title, const string &branch) const
+    {
+        shared_lock<shared_mutex> guard(treeLock);
+        Book *book = searchNode(root, title);
+        auto at = branchIds.find(branch);
+        if (!book || at == branchIds.end() || at->second >= book->holdings.availableAt.size())
+            return 0;
+        return book->holdings.availableAt[at->second];
+    }
+
+    // Calls visit(item, branch name) for each copy of title; returns false if there is no such book
+    template <typename Visit>
+    bool visitCopies(const string &title, Visit visit) const
+    {
+        shared_lock<shared_mutex> guard(treeLock);
+        Book *book = searchNode(root, title);
+        if (!book)
+            return false;
+        for (const Item &item : book->holdings.items)
+            visit(item, branches[item.branch]);
+        return true;
+    }
+
+    // Queues patron for title until expires. Returns false if there is no
+    // such book, it is available, the patron already has it or is waiting
+    // for it, or the log write failed.
+    bool placeHold(const string &title, const string &patron, int64_t expires)
+    {
+        string payload = encodeTitle(title);
+        putString(payload, patron);
+        putU64(payload, (uint64_t)expires);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            Book *book = searchNode(root, title);
+            if (!book || book->available || hasLoan(title, patron) || !holds.place(title, Hold{patron, expires}))
+                return false;
+            lsn = logRecord(WAL_HOLD, payload);
+        }
+        return committed(lsn);
+    }
+
+    bool cancelHold(const string &title, const string &patron)
+    {
+        string payload = encodeTitle(title);
+        putString(payload, patron);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            if (!holds.cancel(title, patron))
+                return false;
+            lsn = logRecord(WAL_CANCEL_HOLD, payload);
+        }
+        return committed(lsn);
+    }
+
+    // Drops the holds that have lapsed; returns how many
+    size_t expireHolds()
+    {
+        int64_t now = nowSeconds();
+        size_t expired;
+        uint64_t lsn = 0;
+        {
+            unique_lock<shared_mutex> guard(treeLock);
+            expired = holds.expire(now);
+            if (expired)
+            {
+                string payload;
+                putU64(payload, (uint64_t)now);
+                lsn = logRecord(WAL_EXPIRE_HOLDS, payload);
+            }
+        }
+        committed(lsn);
+        return expired;
+    }
+
+    // Calls visit(hold) for title's holds, first in line first
+    template <typename Visit>
+    void visitHolds(const string &title, Visit visit) const
+    {
+        shared_lock<shared_mutex> guard(treeLock);
+        holds.visit(title, visit);
+    }
+
+    // Calls visit(loan) for up to limit loans due in [from, until), earliest
+    // first: loans overdue now are those due in [INT64_MIN, nowSeconds())
+    template <typename Visit>
+    void visitLoansDue(int64_t from, int64_t until, size_t limit, Visit visit) const
+    {
+        shared_lock<shared_mutex> guard(treeLock);
+        dueIndex.visit(from, until, limit, [&](uint64_t id) { visit(loans.at(id)); });
+    }
+
+    template <typename Visit>
+    void visitPatronLoans(const string &patron, Visit visit) const
+    {
+        shared_lock<shared_mutex> guard(treeLock);
+        auto held = patronLoans.find(patron);
+        if (held != patronLoans.end())
+            for (uint64_t id : held->second)
+                visit(loans.at(id));
+    }
+};
+
+void putJsonString(string &out, const string &value)
+{
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (unsigned char c : value)
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += (char)c;
+        }
+        else if (c < 0x20)
+        {
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+        else
+            out += (char)c;
+    out += '"';
+}
+
+void putBookJson(string &out, const Book &book)
+{
+    out += "{\"title\":";
+    putJsonString(out, book.title);
+    out += ",\"author\":";
+    putJsonString(out, book.author);
+    out += ",\"year\":" + to_string(book.year) + ",\"isbn\":";
+    putJsonString(out, book.isbn);
+    out += book.available ? ",\"available\":true}" : ",\"available\":false}";
+}
+
+bool getJsonString(const char *&p, const char *end, string &value)
+{
+    if (p == end || *p++ != '"')
+        return false;
+    value.clear();
+    while (p < end && *p != '"')
+    {
+        char c = *p++;
+        if (c != '\\')
+        {
+            value += c;
+            continue;
+        }
+        if (p == end)
+            return false;
+        c = *p++;
+        const char *escapes = "\"\"\\\\//b\bf\fn\nr\rt\t";
+        const char *hit = c ? strchr(escapes, c) : nullptr;
+        if (hit && (hit - escapes) % 2 == 0)
+            value += hit[1];
+        else if (c == 'u' && end - p >= 4 && all_of(p, p + 4, [](char h) { return isxdigit((unsigned char)h); }))
+        {
+            unsigned code = stoul(string(p, 4), nullptr, 16);
+            p += 4;
+            if (code < 0x80)
+                value += (char)code;
+            else if (code < 0x800)
+                value += {(char)(0xC0 | code >> 6), (char)(0x80 | (code & 0x3F))};
+            else
+                value += {(char)(0xE0 | code >> 12), (char)(0x80 | (code >> 6 & 0x3F)), (char)(0x80 | (code & 0x3F))};
+        }
+        else
+            return false;
+    }
+    return p++ < end;
+}
+
+// Reads a flat JSON object such as {"title":"...","author":"...","year":1999,
+// "isbn":"...","available":true} into book; other keys are ignored
+bool parseBookJson(const string &body, Book &book)
+{
+    const char *p = body.data(), *end = p + body.size();
+    auto skip = [&] {
+        while (p < end && isspace((unsigned char)*p))
+            p++;
+    };
+    skip();
+    if (p == end || *p++ != '{')
+        return false;
+    string key, text;
+    for (bool first = true;; first = false)
+    {
+        skip();
+        if (p < end && *p == '}' && first)
+            break;
+        if (!getJsonString(p, end, key))
+            return false;
+        skip();
+        if (p == end || *p++ != ':')
+            return false;
+        skip();
+        if (p < end && *p == '"')
+        {
+            if (!getJsonString(p, end, text))
+                return false;
+            if (key == "title")
+                book.title = text;
+            else if (key == "author")
+                book.author = text;
+            else if (key == "isbn")
+                book.isbn = text;
+            else if (key == "year")
+                return false;
+        }
+        else
+        {
+            const char *start = p;
+            while (p < end && (isalnum((unsigned char)*p) || *p == '-' || *p == '.' || *p == '+'))
+                p++;
+            text.assign(start, p);
+            char *stop;
+            long number = strtol(text.c_str(), &stop, 10);
+            if (key == "year" && !text.empty() && !*stop)
+                book.year = (int)number;
+            else if (key == "available" && (text == "true" || text == "false"))
+                book.available = text == "true";
+            else if (text != "null" && text != "true" && text != "false" && (text.empty() || *stop))
+                return false;
+        }
+        skip();
+        if (p < end && *p == ',')
+        {
+            p++;
+            continue;
+        }
+        if (p == end || *p++ != '}')
+            return false;
+        break;
+    }
+    skip();
+    return p == end;
+}
+
+// Decodes %XX escapes, and + as a space when plus is set (query strings)
+string urlDecode(const string &text, bool plus)
+{
+    string out;
+    for (size_t i = 0; i < text.size(); i++)
+        if (text[i] == '%' && i + 2 < text.size() && isxdigit((unsigned char)text[i + 1]) &&
+            isxdigit((unsigned char)text[i + 2]))
+        {
+            out += (char)stoi(text.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        }
+        else
+            out += plus && text[i] == '+' ? ' ' : text[i];
+    return out;
+}
+
+atomic<bool> stopRequested(false);
+
+void requestStop(int)
+{
+    stopRequested.store(true);
+}
+
+// Line protocol spoken by CatalogServer. One request per line with
+// tab-separated fields; clients may pipeline requests on a connection and
+// replies come back in request order.
+//   PING | GET title | SEARCH text | LIST
+//   ADD title author year [isbn] | DEL title | TOGGLE title
+// A reply is "OK n" followed by n book lines (title, author, year, isbn and
+// 1 or 0 for availability, tab-separated), or a single "OK", "NOTFOUND",
+// "EXISTS" or "ERR message" line. A change is answered once the log has it
+// ("ERR log write failed" if that failed); the loop serves other requests
+// meanwhile, and pipelined changes can share one sync.
+//
+// HTTP listeners serve JSON on the same event loops:
+//   GET /books[?prefix=P]  every book whose title starts with P, as a JSON
+//                          array streamed in chunks
+//   GET /books/{isbn}      one book, or 404
+//   POST /books            adds the book in the JSON body; 201 or 409, or
+//                          503 if the log write failed
+// Connections are kept alive unless the client asks otherwise.
+class CatalogServer
+{
+private:
+    static const size_t READ_SIZE = 64 << 10;
+    static const size_t MAX_BACKLOG = 4 << 20; // unsent reply bytes before reads pause
+    static const size_t MAX_LINE = 1 << 20;
+    static const size_t MAX_HEADER = 16 << 10;
+    static const size_t MAX_BODY = 1 << 20;
+    static const size_t STREAM_BATCH = 256; // books per chunk of a streamed list
+    static const size_t MAX_HELD = 4096;    // replies waiting on the log before reads pause
+
+    // A reply to a change, held until the log has it; failed goes out instead
+    // if the log write failed. Replies after it wait too, to keep the order.
+    struct HeldReply
+    {
+        uint64_t lsn;
+        string reply, failed;
+    };
+
+    struct Connection
+    {
+        int fd;
+        bool listener, http;
+        bool peerClosed = false;
+        bool closeAfterWrite = false; // HTTP: the last response said Connection: close
+        uint32_t events = EPOLLIN;
+        string in, out;
+        size_t sent = 0;
+
+        // An HTTP list being streamed: the title prefix, the last title sent
+        // and whether the body is chunked (HTTP/1.1) or ends at close (1.0)
+        bool streaming = false, streamStarted, chunked;
+        string streamPrefix, streamCursor;
+
+        deque<HeldReply> held;
+
+        Connection(int f, bool l, bool h) : fd(f), listener(l), http(h) {}
+    };
+
+    LibrarySystem &library;
+    vector<Connection *> listeners;
+    string unixPath;
+    vector<int> wakeFds; // one eventfd per event loop, signalled as the log syncs
+
+    static void putBookLine(string &out, const Book &book)
+    {
+        out += book.title;
+        out += '\t';
+        out += book.author;
+        out += '\t';
+        out += to_string(book.year);
+        out += '\t';
+        out += book.isbn;
+        out += book.available ? "\t1\n" : "\t0\n";
+    }
+
+    static void putLoanLine(string &out, const Loan &loan)
+    {
+        out += loan.title;
+        out += '\t';
+        out += loan.patron;
+        out += '\t';
+        out += to_string(loan.due);
+        if (loan.copy)
+            out += '\t' + to_string(loan.copy);
+        out += '\n';
+    }
+
+    static bool parseCopy(const string &text, uint32_t &copy)
+    {
+        char *end;
+        unsigned long value = strtoul(text.c_str(), &end, 10);
+        copy = (uint32_t)value;
+        return !text.empty() && !*end && value && value <= UINT32_MAX;
+    }
+
+    void execute(const string &line, string &out)
+    {
+        vector<string> args;
+        for (size_t at = 0;; at++)
+        {
+            size_t tab = line.find('\t', at);
+            args.push_back(line.substr(at, tab - at));
+            if (tab == string::npos)
+                break;
+            at = tab;
+        }
+        const string &cmd = args[0];
+        if (cmd == "PING" && args.size() == 1)
+            out += "OK\n";
+        else if (cmd == "GET" && args.size() == 2)
+        {
+            Book book("", "", 0);
+            if (library.copyBook(args[1], book))
+            {
+                out += "OK 1\n";
+                putBookLine(out, book);
+            }
+            else
+                out += "NOTFOUND\n";
+        }
+        else if ((cmd == "SEARCH" && args.size() == 2) || (cmd == "LIST" && args.size() == 1))
+        {
+            string rows;
+            size_t count = 0;
+            library.visitBooks(args.size() == 2 ? args[1] : "", [&](const Book &book) {
+                putBookLine(rows, book);
+                count++;
+            });
+            out += "OK " + to_string(count) + "\n";
+            out += rows;
+        }
+        else if (cmd == "ADD" && (args.size() == 4 || args.size() == 5) && !args[1].empty())
+        {
+            char *end;
+            long year = strtol(args[3].c_str(), &end, 10);
+            if (args[3].empty() || *end)
+                out += "ERR bad year\n";
+            else
+                out += library.addBook(args[1], args[2], (int)year, args.size() == 5 ? args[4] : "") ? "OK\n"
+                                                                                                     : "EXISTS\n";
+        }
+        else if (cmd == "DEL" && args.size() == 2)
+            out += library.removeBook(args[1]) ? "OK\n" : "NOTFOUND\n";
+        else if (cmd == "TOGGLE" && args.size() == 2)
+            out += library.toggleAvailability(args[1]) ? "OK\n" : "NOTFOUND\n";
+        else if (cmd == "CHECKOUT" && (args.size() == 4 || args.size() == 5) && !args[2].empty())
+        {
+            // Due dates go out as seconds since the epoch, followed by the
+            // copy lent if the title has copies
+            char *end;
+            long days = strtol(args[3].c_str(), &end, 10);
+            uint32_t copy = 0;
+            if (args[3].empty() || *end || days < 0 || days > MAX_PERIOD_DAYS)
+                out += "ERR bad days\n";
+            else
+            {
+                int64_t due = nowSeconds() + (int64_t)days * 86400;
+                if (library.checkOut(args[1], args[2], due, args.size() == 5 ? args[4] : "", &copy))
+                    out += "OK " + to_string(due) + (copy ? "\t" + to_string(copy) : "") + "\n";
+                else
+                    out += "UNAVAILABLE\n";
+            }
+        }
+        else if (cmd == "RETURN" && (args.size() == 2 || args.size() == 3))
+        {
+            // OK is followed by the patron the book went to, if it was held
+            string heldFor;
+            uint32_t copy = 0;
+            if (args.size() == 3 && !parseCopy(args[2], copy))
+                out += "ERR bad copy\n";
+            else
+                out += library.returnBook(args[1], copy, &heldFor)
+                           ? (heldFor.empty() ? "OK\n" : "OK\t" + heldFor + "\n")
+                           : "NOTFOUND\n";
+        }
+        else if (cmd == "ADDCOPY" && (args.size() == 3 || args.size() == 4))
+        {
+            uint32_t copy = library.addCopy(args[1], args[2], args.size() == 4 ? args[3] : "");
+            out += copy ? "OK " + to_string(copy) + "\n" : "NOTFOUND\n";
+        }
+        else if ((cmd == "DELCOPY" && args.size() == 3) || (cmd == "COPYSTATUS" && args.size() == 4))
+        {
+            uint32_t copy;
+            if (!parseCopy(args[2], copy) || (cmd == "COPYSTATUS" && args[3] != "1" && args[3] != "0"))
+                out += "ERR bad copy\n";
+            else if (cmd == "DELCOPY")
+                out += library.removeCopy(args[1], copy) ? "OK\n" : "NOTFOUND\n";
+            else
+                out += library.setCopyStatus(args[1], copy, args[3] == "1") ? "OK\n" : "REFUSED\n";
+        }
+        else if (cmd == "COPIES" && args.size() == 2)
+        {
+            // copy, branch, call number and status (available, on loan or withdrawn)
+            static const char *const statuses[] = {"available", "loan", "withdrawn"};
+            string rows;
+            size_t count = 0;
+            bool found = library.visitCopies(args[1], [&](const Item &item, const string &branch) {
+                rows += to_string(item.copy) + "\t" + branch + "\t" + item.callNumber + "\t" + statuses[item.status] + "\n";
+                count++;
+            });
+            out += found ? "OK " + to_string(count) + "\n" + rows : "NOTFOUND\n";
+        }
+        else if (cmd == "ATBRANCH" && args.size() == 3)
+            out += "OK " + to_string(library.availableAt(args[1], args[2])) + "\n";
+        else if (cmd == "HOLD" && args.size() == 4 && !args[2].empty())
+        {
+            char *end;
+            long days = strtol(args[3].c_str(), &end, 10);
+            if (args[3].empty() || *end || days <= 0 || days > MAX_PERIOD_DAYS)
+                out += "ERR bad days\n";
+            else
+                out += library.placeHold(args[1], args[2], nowSeconds() + (int64_t)days * 86400) ? "OK\n"
+                                                                                                   : "REFUSED\n";
+        }
+        else if (cmd == "UNHOLD" && args.size() == 3)
+            out += library.cancelHold(args[1], args[2]) ? "OK\n" : "NOTFOUND\n";
+        else if (cmd == "HOLDS" && args.size() == 2)
+        {
+            string rows;
+            size_t count = 0;
+            library.visitHolds(args[1], [&](const Hold &hold) {
+                rows += hold.patron + "\t" + to_string(hold.expires) + "\n";
+                count++;
+            });
+            out += "OK " + to_string(count) + "\n";
+            out += rows;
+        }
+        else if ((cmd == "OVERDUE" && args.size() == 1) || (cmd == "DUE" && args.size() == 2) ||
+                 (cmd == "LOANS" && args.size() == 2))
+        {
+            // OVERDUE lists loans past due, DUE n the next n coming due and LOANS a patron's
+            string rows;
+            size_t count = 0;
+            auto add = [&](const Loan &loan) {
+                putLoanLine(rows, loan);
+                count++;
+            };
+            int64_t now = nowSeconds();
+            if (cmd == "OVERDUE")
+                library.visitLoansDue(INT64_MIN, now, SIZE_MAX, add);
+            else if (cmd == "DUE")
+                library.visitLoansDue(now, INT64_MAX, strtoul(args[1].c_str(), nullptr, 10), add);
+            else
+                library.visitPatronLoans(args[1], add);
+            out += "OK " + to_string(count) + "\n";
+            out += rows;
+        }
+        else
+            out += "ERR bad request\n";
+    }
+
+    void httpRespond(Connection &c, int status, const string &body)
+    {
+        static const unordered_map<int, string> reasons = {
+            {200, "OK"}, {201, "Created"}, {400, "Bad Request"}, {404, "Not Found"}, {405, "Method Not Allowed"},
+            {409, "Conflict"}, {413, "Payload Too Large"}, {431, "Request Header Fields Too Large"},
+            {501, "Not Implemented"}, {503, "Service Unavailable"}};
+        c.out += "HTTP/1.1 " + to_string(status) + " " + reasons.at(status) +
+                 "\r\nContent-Type: application/json\r\nContent-Length: " + to_string(body.size()) + "\r\n";
+        if (c.closeAfterWrite)
+            c.out += "Connection: close\r\n";
+        c.out += "\r\n";
+        c.out += body;
+    }
+
+    void httpError(Connection &c, int status, const string &message)
+    {
+        string body = "{\"error\":";
+        putJsonString(body, message);
+        httpRespond(c, status, body + "}");
+    }
+
+    void route(Connection &c, const string &method, const string &target, const string &body, bool http11)
+    {
+        size_t q = target.find('?');
+        string path = target.substr(0, q), query = q == string::npos ? "" : target.substr(q + 1);
+        if (path == "/books" && method == "GET")
+        {
+            c.streamPrefix.clear();
+            for (size_t at = 0; at < query.size();)
+            {
+                size_t amp = min(query.find('&', at), query.size());
+                string pair = query.substr(at, amp - at);
+                if (pair.compare(0, 7, "prefix=") == 0)
+                    c.streamPrefix = urlDecode(pair.substr(7), true);
+                at = amp + 1;
+            }
+            c.out += "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n";
+            c.chunked = http11;
+            if (!c.chunked)
+                c.closeAfterWrite = true; // HTTP/1.0 has no chunks; the body ends at close
+            c.out += c.chunked ? "Transfer-Encoding: chunked\r\n" : "Connection: close\r\n";
+            if (c.chunked && c.closeAfterWrite)
+                c.out += "Connection: close\r\n";
+            c.out += "\r\n";
+            c.streaming = true;
+            c.streamStarted = false;
+            c.streamCursor.clear();
+        }
+        else if (path == "/books" && method == "POST")
+        {
+            Book book("", "", 0);
+            if (!parseBookJson(body, book) || book.title.empty())
+                httpError(c, 400, "expected a JSON object with at least a title");
+            else if (!library.addBook(book.title, book.author, book.year, book.isbn, book.available))
+                httpError(c, 409, "a book with that title already exists");
+            else
+            {
+                string json;
+                putBookJson(json, book);
+                httpRespond(c, 201, json);
+            }
+        }
+        else if (path.compare(0, 7, "/books/") == 0 && path.size() > 7 && method == "GET")
+        {
+            Book book("", "", 0);
+            if (library.copyBookByIsbn(urlDecode(path.substr(7), false), book))
+            {
+                string json;
+                putBookJson(json, book);
+                httpRespond(c, 200, json);
+            }
+            else
+                httpError(c, 404, "no book has that ISBN");
+        }
+        else if (path == "/books" || path.compare(0, 7, "/books/") == 0)
+            httpError(c, 405, "method not allowed");
+        else
+            httpError(c, 404, "not found");
     }
 
-    void inOrder(Node *root, vector<Book *> &books)
+    // Holds back the reply c.out gained since start if it waits on the log
+    // (lsn) or follows a reply that does; otherwise leaves it to be sent
+    void holdReply(Connection &c, uint64_t lsn, size_t start)
     {
-        if (!root)
+        if (c.held.empty() && !lsn)
             return;
-
-        inOrder(root->left, books);
-        books.push_back(&root->book);
-        inOrder(root->right, books);
+        string failed;
+        if (lsn)
+        {
+            size_t end = c.out.size();
+            if (c.http)
+                httpError(c, 503, "the change could not be written to the log");
+            else
+                c.out += "ERR log write failed\n";
+            failed = c.out.substr(end);
+            c.out.resize(end);
+        }
+        c.held.push_back(HeldReply{lsn, c.out.substr(start), failed});
+        c.out.resize(start);
+        releaseHeld(c);
     }
 
-    void partialSearch(Node *root, string partialTitle, vector<Book *> &results)
+    // Moves the held replies whose changes are now on disk to the output
+    void releaseHeld(Connection &c)
     {
-        if (!root)
-            return;
-
-        partialSearch(root->left, partialTitle, results);
-
-        string lowerTitle = root->book.title;
-        transform(lowerTitle.begin(), lowerTitle.end(), lowerTitle.begin(), ::tolower);
-
-        string lowerSearch = partialTitle;
-        transform(lowerSearch.begin(), lowerSearch.end(), lowerSearch.begin(), ::tolower);
+        bool ok;
+        while (!c.held.empty() && library.logged(c.held.front().lsn, ok))
+        {
+            HeldReply &front = c.held.front();
+            c.out += ok || !front.lsn ? front.reply : front.failed;
+            c.held.pop_front();
+        }
+    }
 
-        if (lowerTitle.find(lowerSearch) != string::npos)
+    // Answers the complete HTTP requests buffered on c, in order, stopping at
+    // one whose response is a stream; the rest wait until it has been sent
+    void serviceHttp(Connection &c)
+    {
+        while (!c.streaming && !c.closeAfterWrite)
         {
-            results.push_back(&root->book);
+            size_t start = c.out.size();
+            uint64_t lsn = 0;
+            bool more;
+            {
+                LibrarySystem::DeferCommits defer(lsn);
+                more = serviceHttpRequest(c);
+            }
+            holdReply(c, lsn, start);
+            if (!more)
+                return;
         }
+    }
 
-        partialSearch(root->right, partialTitle, results);
+    // Answers the first complete HTTP request buffered on c, if any; false
+    // if there is none or the connection takes no more
+    bool serviceHttpRequest(Connection &c)
+    {
+        size_t headerEnd = c.in.find("\r\n\r\n");
+        if (headerEnd == string::npos)
+        {
+            if (c.in.size() > MAX_HEADER)
+            {
+                c.closeAfterWrite = true;
+                httpError(c, 431, "request header too large");
+            }
+            return false;
+        }
+        istringstream head(c.in.substr(0, headerEnd));
+        string requestLine, method, target, version, line;
+        getline(head, requestLine);
+        istringstream(requestLine) >> method >> target >> version;
+        size_t length = 0;
+        bool badLength = false, chunkedBody = false;
+        string connection;
+        while (getline(head, line))
+        {
+            size_t colon = line.find(':');
+            if (colon == string::npos)
+                continue;
+            string name = line.substr(0, colon), value = line.substr(colon + 1);
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t\r") + 1);
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (name == "content-length")
+            {
+                char *stop;
+                length = strtoul(value.c_str(), &stop, 10);
+                badLength = value.empty() || *stop;
+            }
+            else if (name == "transfer-encoding")
+                chunkedBody = value != "identity";
+            else if (name == "connection")
+                connection = value;
+        }
+        bool http11 = version == "HTTP/1.1";
+        c.closeAfterWrite = http11 ? connection == "close" : connection != "keep-alive";
+        if (version.compare(0, 5, "HTTP/") != 0 || target.empty() || target[0] != '/' || badLength)
+        {
+            c.closeAfterWrite = true;
+            httpError(c, 400, "malformed request");
+            return false;
+        }
+        if (chunkedBody || length > MAX_BODY)
+        {
+            c.closeAfterWrite = true;
+            httpError(c, chunkedBody ? 501 : 413, chunkedBody ? "chunked request bodies are not supported"
+                                                               : "request body too large");
+            return false;
+        }
+        if (c.in.size() < headerEnd + 4 + length)
+            return false;
+        string body = c.in.substr(headerEnd + 4, length);
+        c.in.erase(0, headerEnd + 4 + length);
+        route(c, method, target, body, http11);
+        return true;
     }
 
-    void clearTree(Node *node)
+    // Appends the next batch of a streamed list to the output and, once the
+    // list is done, answers the requests that were pipelined behind it
+    void fillStream(Connection &c)
     {
-        if (!node)
+        string items = c.streamStarted ? "" : "[";
+        bool first = !c.streamStarted;
+        bool more = library.visitPrefix(c.streamPrefix, c.streamStarted ? &c.streamCursor : nullptr, STREAM_BATCH,
+                                        [&](const Book &book) {
+                                            if (!first)
+                                                items += ',';
+                                            first = false;
+                                            items += '\n';
+                                            putBookJson(items, book);
+                                            c.streamCursor = book.title;
+                                        });
+        c.streamStarted = true;
+        if (!more)
+            items += "\n]\n";
+        if (c.chunked)
+        {
+            char size[20];
+            snprintf(size, sizeof(size), "%zx\r\n", items.size());
+            c.out += size;
+            c.out += items;
+            c.out += more ? "\r\n" : "\r\n0\r\n\r\n";
+        }
+        else
+            c.out += items;
+        if (more)
             return;
-
-        clearTree(node->left);
-        clearTree(node->right);
-        delete node;
+        c.streaming = false;
+        serviceHttp(c);
     }
 
-public:
-    LibrarySystem() : root(nullptr) {}
-
-    ~LibrarySystem()
+    // Reads what the socket has and answers every complete request in it;
+    // false on a socket error or an overlong request line
+    bool serviceRead(Connection &c)
     {
-        clearTree(root);
+        size_t parsed = 0;
+        while (c.out.size() - c.sent < MAX_BACKLOG && c.held.size() < MAX_HELD && !c.streaming &&
+               !c.closeAfterWrite)
+        {
+            size_t used = c.in.size();
+            c.in.resize(used + READ_SIZE);
+            ssize_t n = read(c.fd, &c.in[used], READ_SIZE);
+            c.in.resize(used + max<ssize_t>(n, 0));
+            if (n == 0)
+                c.peerClosed = true;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno != EAGAIN)
+                return false;
+
+            if (c.http)
+            {
+                serviceHttp(c);
+                if (n <= 0)
+                    break;
+                continue;
+            }
+            string line;
+            for (size_t nl; (nl = c.in.find('\n', parsed)) != string::npos; parsed = nl + 1)
+            {
+                line.assign(c.in, parsed, nl - parsed);
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                if (line.empty())
+                    continue;
+                size_t start = c.out.size();
+                uint64_t lsn = 0;
+                {
+                    LibrarySystem::DeferCommits defer(lsn);
+                    execute(line, c.out);
+                }
+                holdReply(c, lsn, start);
+            }
+            if (n <= 0)
+                break;
+        }
+        c.in.erase(0, parsed);
+        return c.http || c.in.size() <= MAX_LINE;
     }
 
-    void addBook(string title, string author, int year, string isbn = "", bool available = true)
+    // Sends as much of the queued replies as the socket takes
+    bool serviceWrite(Connection &c)
     {
-        Book newBook(title, author, year, isbn, available);
-        root = insertNode(root, newBook);
-        cout << "Book added successfully!" << endl;
+        while (c.sent < c.out.size())
+        {
+            ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                return true;
+            if (n <= 0)
+                return false;
+            c.sent += n;
+        }
+        c.out.clear();
+        c.sent = 0;
+        return true;
     }
 
-    bool removeBook(string title)
+    // Sends queued output, refilling it from an active stream until the
+    // socket is full or the stream is done; a stream waits for held replies
+    bool flushOutput(Connection &c)
     {
-        Book *book = searchNode(root, title);
-        if (!book)
-            return false;
-
-        root = deleteNode(root, title);
-        return true;
+        while (true)
+        {
+            if (!serviceWrite(c))
+                return false;
+            if (c.sent < c.out.size() || !c.streaming || !c.held.empty())
+                return true;
+            fillStream(c);
+        }
     }
 
-    Book *findBook(string title)
+    // One event loop; every loop waits on the listeners (EPOLLEXCLUSIVE wakes
+    // just one of them per new connection) and owns the connections it accepts.
+    // wake is its eventfd, signalled whenever held replies may be released.
+    void loop(int wake)
     {
-        return searchNode(root, title);
+        int ep = epoll_create1(EPOLL_CLOEXEC);
+        for (Connection *l : listeners)
+        {
+            epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = l;
+            epoll_ctl(ep, EPOLL_CTL_ADD, l->fd, &ev);
+        }
+        epoll_event wakeEvent = {};
+        wakeEvent.events = EPOLLIN;
+        wakeEvent.data.ptr = nullptr;
+        epoll_ctl(ep, EPOLL_CTL_ADD, wake, &wakeEvent);
+        vector<Connection *> open;
+
+        // Sends what c has queued, then closes it or updates what it waits for
+        auto settle = [&](Connection *c, bool alive) {
+            alive = alive && flushOutput(*c);
+            bool pending = c->sent < c->out.size();
+            if (!alive || ((c->peerClosed || c->closeAfterWrite) && !pending && !c->streaming && c->held.empty()))
+            {
+                close(c->fd); // also drops it from the epoll set
+                open.erase(find(open.begin(), open.end(), c));
+                delete c;
+                return;
+            }
+            bool paused = c->peerClosed || c->closeAfterWrite || c->streaming ||
+                          c->out.size() - c->sent >= MAX_BACKLOG || c->held.size() >= MAX_HELD;
+            uint32_t wanted = (paused ? 0u : (uint32_t)EPOLLIN) |
+                              (pending ? (uint32_t)EPOLLOUT : 0u);
+            if (wanted != c->events)
+            {
+                epoll_event ev = {};
+                ev.events = c->events = wanted;
+                ev.data.ptr = c;
+                epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+            }
+        };
+
+        epoll_event events[64];
+        while (!stopRequested.load())
+        {
+            int ready = epoll_wait(ep, events, 64, 100);
+            for (int i = 0; i < ready; i++)
+            {
+                Connection *c = (Connection *)events[i].data.ptr;
+                if (!c)
+                {
+                    uint64_t signals;
+                    if (read(wake, &signals, sizeof(signals)) != sizeof(signals))
+                        continue; // nothing signalled since the last read
+                    vector<Connection *> waiting;
+                    for (Connection *conn : open)
+                        if (!conn->held.empty())
+                            waiting.push_back(conn);
+                    for (Connection *conn : waiting)
+                    {
+                        releaseHeld(*conn);
+                        settle(conn, true);
+                    }
+                    continue;
+                }
+                if (c->listener)
+                {
+                    int fd;
+                    while ((fd = accept4(c->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                    {
+                        int one = 1;
+                        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on Unix sockets
+                        Connection *conn = new Connection(fd, false, c->http);
+                        epoll_event ev = {};
+                        ev.events = conn->events;
+                        ev.data.ptr = conn;
+                        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+                        open.push_back(conn);
+                    }
+                    continue;
+                }
+                bool alive = true;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    alive = serviceRead(*c);
+                settle(c, alive);
+            }
+        }
+        for (Connection *c : open)
+        {
+            close(c->fd);
+            delete c;
+        }
+        close(ep);
     }
 
-    vector<Book *> findBooks(string partialTitle)
+    bool addListener(int fd, bool http)
     {
-        vector<Book *> results;
-        partialSearch(root, partialTitle, results);
-        return results;
+        if (listen(fd, SOMAXCONN) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        listeners.push_back(new Connection(fd, true, http));
+        return true;
     }
 
-    vector<Book *> getAllBooks()
+public:
+    explicit CatalogServer(LibrarySystem &lib) : library(lib) {}
+
+    ~CatalogServer()
     {
-        vector<Book *> books;
-        inOrder(root, books);
-        return books;
+        for (Connection *l : listeners)
+        {
+            close(l->fd);
+            delete l;
+        }
+        if (!unixPath.empty())
+            unlink(unixPath.c_str());
     }
 
-    bool updateBook(string title, string newAuthor, int newYear, string newIsbn, bool newAvailable)
+    // Listens on 127.0.0.1:port for the line protocol, or for HTTP
+    bool listenTcp(int port, bool http = false)
     {
-        Book *book = searchNode(root, title);
-        if (!book)
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
             return false;
-
-        book->author = newAuthor;
-        book->year = newYear;
-        book->isbn = newIsbn;
-        book->available = newAvailable;
-
-        return true;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        return addListener(fd, http);
     }
 
-    bool toggleAvailability(string title)
+    bool listenUnix(const string &path)
     {
-        Book *book = searchNode(root, title);
-        if (!book)
+        sockaddr_un addr = {};
+        if (path.size() >= sizeof(addr.sun_path))
+            return false;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return false;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            close(fd);
             return false;
+        }
+        unixPath = path;
+        return addListener(fd, false);
+    }
 
-        book->available = !book->available;
-        return true;
+    // Serves until SIGINT or SIGTERM with the given number of event loops
+    void run(int threads)
+    {
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
+        for (int i = 0; i < max(threads, 1); i++)
+            wakeFds.push_back(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        // A write fails only when the count is saturated, and then the loop is due to wake anyway
+        library.onLogged([this] {
+            uint64_t one = 1;
+            for (int fd : wakeFds)
+                if (write(fd, &one, sizeof(one)) != sizeof(one))
+                    continue;
+        });
+        vector<thread> loops;
+        for (int fd : wakeFds)
+            loops.emplace_back(&CatalogServer::loop, this, fd);
+        // Meanwhile this thread expires lapsed holds about once a second;
+        // nobody waits on the result, so it does not wait for the log either
+        for (int tick = 1; !stopRequested.load(); tick++)
+        {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            if (tick % 10 == 0)
+            {
+                uint64_t lsn = 0;
+                LibrarySystem::DeferCommits defer(lsn);
+                library.expireHolds();
+            }
+        }
+        for (thread &t : loops)
+            t.join();
+        library.onLogged(nullptr);
+        for (int fd : wakeFds)
+            close(fd);
+        wakeFds.clear();
     }
 };
 
@@ -330,8 +2870,15 @@ void displayMenu()
     cout << "5. Update Book Information\n";
     cout << "6. Toggle Book Availability\n";
     cout << "7. Display All Books\n";
-    cout << "8. Exit\n";
-    cout << "Please enter your choice (1-8): ";
+    cout << "8. Check Out a Book\n";
+    cout << "9. Return a Book\n";
+    cout << "10. Show Overdue and Upcoming Loans\n";
+    cout << "11. Show a Patron's Loans\n";
+    cout << "12. Place a Hold\n";
+    cout << "13. Show or Cancel Holds on a Book\n";
+    cout << "14. Manage Copies of a Book\n";
+    cout << "15. Exit\n";
+    cout << "Please enter your choice (1-15): ";
 }
 
 void displayBook(Book *book)
@@ -343,6 +2890,9 @@ void displayBook(Book *book)
     if (!book->isbn.empty())
         cout << "ISBN: " << book->isbn << endl;
     cout << "Status: " << (book->available ? "Available" : "Checked Out") << endl;
+    if (!book->holdings.items.empty())
+        cout << "Copies: " << book->holdings.available << " of " << book->holdings.items.size() << " available"
+             << endl;
     cout << "------------------------------------\n";
 }
 
@@ -373,6 +2923,41 @@ void displayBooks(const vector<Book *> &books)
     cout << string(95, '-') << endl;
 }
 
+string formatDate(int64_t seconds)
+{
+    time_t t = (time_t)seconds;
+    tm local;
+    localtime_r(&t, &local);
+    ostringstream out;
+    out << put_time(&local, "%Y-%m-%d");
+    return out.str();
+}
+
+void displayLoans(const vector<Loan> &loans)
+{
+    if (loans.empty())
+    {
+        cout << "\nNo loans.\n";
+        return;
+    }
+
+    int64_t now = nowSeconds();
+    cout << setw(40) << left << "TITLE"
+         << setw(25) << left << "PATRON"
+         << "DUE" << endl;
+    cout << string(80, '-') << endl;
+    for (const Loan &loan : loans)
+    {
+        cout << setw(40) << left << (loan.title.length() > 37 ? loan.title.substr(0, 37) + "..." : loan.title)
+             << setw(25) << left << (loan.patron.length() > 22 ? loan.patron.substr(0, 22) + "..." : loan.patron)
+             << formatDate(loan.due) << (loan.due < now ? " (overdue)" : "");
+        if (loan.copy)
+            cout << "  copy " << loan.copy;
+        cout << endl;
+    }
+    cout << string(80, '-') << endl;
+}
+
 string getInputLine(const string &prompt)
 {
     string input;
@@ -407,7 +2992,66 @@ int getInputInt(const string &prompt)
     return input;
 }
 
-int main()
+// Reads a whole decimal command-line number in [lo, hi]
+bool parseOption(const char *text, long lo, long hi, long &value)
+{
+    char *end;
+    errno = 0;
+    value = strtol(text, &end, 10);
+    return *text && !*end && errno != ERANGE && value >= lo && value <= hi;
+}
+
+// Measures commit throughput and latency of the log alone at several group
+// sizes. Many writer threads commit concurrently so groups can fill up.
+void runWalBenchmark(const string &dir)
+{
+    const int writers = 256, commitsPerWriter = 16;
+    const chrono::microseconds window(2000);
+    string payload;
+    putBook(payload, Book("Benchmark Title", "Benchmark Author", 2024, "9780000000000"));
+
+    cout << setw(8) << left << "BATCH"
+         << setw(14) << left << "COMMITS/SEC"
+         << setw(12) << left << "P50 (us)"
+         << "P99 (us)" << endl;
+    for (size_t batch : {1, 16, 256})
+    {
+        string path = dir + "/bench.wal";
+        remove(path.c_str());
+        WriteAheadLog wal;
+        if (!wal.open(path, batch, window))
+        {
+            cout << "Error: cannot create " << path << "." << endl;
+            return;
+        }
+        vector<double> latencies(writers * commitsPerWriter);
+        auto start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (int w = 0; w < writers; w++)
+            threads.emplace_back([&, w]
+                                 {
+                for (int i = 0; i < commitsPerWriter; i++)
+                {
+                    auto begin = chrono::steady_clock::now();
+                    wal.waitDurable(wal.append(WAL_ADD, payload));
+                    latencies[w * commitsPerWriter + i] =
+                        chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count();
+                } });
+        for (thread &t : threads)
+            t.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        wal.close();
+        remove(path.c_str());
+
+        sort(latencies.begin(), latencies.end());
+        cout << setw(8) << left << batch
+             << setw(14) << left << (long)(latencies.size() / seconds)
+             << setw(12) << left << (long)latencies[latencies.size() / 2]
+             << (long)latencies[latencies.size() * 99 / 100] << endl;
+    }
+}
+
+int main(int argc, char *argv[])
 {
     LibrarySystem library;
     int choice;
@@ -415,18 +3059,79 @@ int main()
     int year;
     bool running = true;
 
+    string dataDir, socketPath;
+    size_t groupSize = 16;
+    long windowMicros = 1000;
+    int port = 0, httpPort = 0, threads = max(1u, thread::hardware_concurrency());
+    long value;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--data" && i + 1 < argc)
+            dataDir = argv[++i];
+        else if (arg == "--group" && i + 1 < argc && parseOption(argv[++i], 1, 1 << 20, value))
+            groupSize = value;
+        else if (arg == "--window-us" && i + 1 < argc && parseOption(argv[++i], 0, 10000000, value))
+            windowMicros = value;
+        else if (arg == "--port" && i + 1 < argc && parseOption(argv[++i], 1, 65535, value))
+            port = value;
+        else if (arg == "--http-port" && i + 1 < argc && parseOption(argv[++i], 1, 65535, value))
+            httpPort = value;
+        else if (arg == "--socket" && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc && parseOption(argv[++i], 1, 1024, value))
+            threads = value;
+        else if (arg == "--wal-bench" && i + 1 < argc)
+        {
+            runWalBenchmark(argv[++i]);
+            return 0;
+        }
+        else
+        {
+            cout << "Usage: " << argv[0] << " [--data DIR [--group N] [--window-us N]]"
+                 << " [--port N] [--http-port N] [--socket PATH] [--threads N] | [--wal-bench DIR]" << endl;
+            return 1;
+        }
+    }
+    if (!dataDir.empty() && !library.open(dataDir, groupSize, chrono::microseconds(windowMicros)))
+    {
+        cout << "Error: cannot open the catalog in " << dataDir << "." << endl;
+        return 1;
+    }
+
     // Add some sample books
-    library.addBook("Harry Potter and the Philosopher's Stone", "J.K. Rowling", 1997, "9780747532743");
-    library.addBook("The Hobbit", "J.R.R. Tolkien", 1937, "9780618260300");
-    library.addBook("1984", "George Orwell", 1949, "9780451524935");
-    library.addBook("To Kill a Mockingbird", "Harper Lee", 1960, "9780446310789");
-    library.addBook("Pride and Prejudice", "Jane Austen", 1813, "9780141439518");
+    if (library.getAllBooks().empty())
+    {
+        library.addBook("Harry Potter and the Philosopher's Stone", "J.K. Rowling", 1997, "9780747532743");
+        library.addBook("The Hobbit", "J.R.R. Tolkien", 1937, "9780618260300");
+        library.addBook("1984", "George Orwell", 1949, "9780451524935");
+        library.addBook("To Kill a Mockingbird", "Harper Lee", 1960, "9780446310789");
+        library.addBook("Pride and Prejudice", "Jane Austen", 1813, "9780141439518");
+    }
 
-    cout << "Welcome to the Library Management System!" << endl;
-    cout << "Sample books have been added to get you started." << endl;
+    // --port, --http-port and --socket run the catalog as a server instead of the menu
+    if (port || httpPort || !socketPath.empty())
+    {
+        CatalogServer server(library);
+        if ((port && !server.listenTcp(port)) || (httpPort && !server.listenTcp(httpPort, true)) ||
+            (!socketPath.empty() && !server.listenUnix(socketPath)))
+        {
+            cout << "Error: cannot listen on the requested address." << endl;
+            return 1;
+        }
+        cout << "Serving the catalog with " << threads << " threads; press Ctrl+C to stop." << endl;
+        server.run(threads);
+        running = false;
+    }
+    else
+    {
+        cout << "Welcome to the Library Management System!" << endl;
+        cout << "Sample books have been added to get you started." << endl;
+    }
 
     while (running)
     {
+        library.expireHolds();
         displayMenu();
         cin >> choice;
 
@@ -446,7 +3151,10 @@ int main()
             cout << "Enter ISBN (optional): ";
             getline(cin, isbn);
 
-            library.addBook(title, author, year, isbn);
+            if (library.addBook(title, author, year, isbn))
+                cout << "Book added successfully!" << endl;
+            else
+                cout << "A book with that title already exists." << endl;
             break;
         }
         case 2:
@@ -532,10 +3240,15 @@ int main()
                 if (isbn.empty())
                     isbn = book->isbn;
 
-                string availStr;
-                cout << "Availability (y/n) [" << (book->available ? "y" : "n") << "]: ";
-                getline(cin, availStr);
-                bool avail = availStr.empty() ? book->available : (availStr == "y" || availStr == "Y");
+                // a title with copies is available when one of them is
+                bool avail = book->available;
+                if (book->holdings.items.empty())
+                {
+                    string availStr;
+                    cout << "Availability (y/n) [" << (book->available ? "y" : "n") << "]: ";
+                    getline(cin, availStr);
+                    avail = availStr.empty() ? book->available : (availStr == "y" || availStr == "Y");
+                }
 
                 if (library.updateBook(title, author, year, isbn, avail))
                 {
@@ -559,9 +3272,11 @@ int main()
             cout << "Enter the exact title of the book: ";
             getline(cin, title);
 
-            if (library.toggleAvailability(title))
+            Book *book = library.findBook(title);
+            if (book && !book->holdings.items.empty())
+                cout << "That book has copies; withdraw or restore them under Manage Copies." << endl;
+            else if (library.toggleAvailability(title))
             {
-                Book *book = library.findBook(title);
                 cout << "Book '" << title << "' is now "
                      << (book->available ? "available" : "checked out") << "." << endl;
             }
@@ -578,6 +3293,191 @@ int main()
             break;
         }
         case 8:
+        { // Check Out a Book
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "\n-- CHECK OUT A BOOK --\n";
+            cout << "Enter the exact title of the book: ";
+            getline(cin, title);
+            string patron, branch;
+            cout << "Enter the patron's name or card number: ";
+            getline(cin, patron);
+            Book *book = library.findBook(title);
+            if (book && !book->holdings.items.empty())
+            {
+                cout << "Branch to lend from (blank for any): ";
+                getline(cin, branch);
+            }
+            int days = getInputInt("Loan period in days: ");
+
+            uint32_t copy = 0;
+            if (!book)
+                cout << "Book not found. Please check the title and try again." << endl;
+            else if (!book->available)
+                cout << "That book is already checked out." << endl;
+            else if (patron.empty() || days < 0 || days > MAX_PERIOD_DAYS)
+                cout << "A patron and a loan period of 0 to " << MAX_PERIOD_DAYS << " days are required." << endl;
+            else
+            {
+                int64_t due = nowSeconds() + (int64_t)days * 86400;
+                if (library.checkOut(title, patron, due, branch, &copy))
+                {
+                    cout << "Checked out to " << patron << ", due " << formatDate(due) << "." << endl;
+                    if (copy)
+                        cout << "Copy number: " << copy << endl;
+                }
+                else if (!branch.empty())
+                    cout << "No copy is available at " << branch << "." << endl;
+                else
+                    cout << "The book could not be checked out." << endl;
+            }
+            break;
+        }
+        case 9:
+        { // Return a Book
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "\n-- RETURN A BOOK --\n";
+            cout << "Enter the exact title of the book: ";
+            getline(cin, title);
+
+            Book *book = library.findBook(title);
+            uint32_t copy = 0;
+            if (book && !book->holdings.items.empty())
+                copy = getInputInt("Copy number: ");
+
+            string heldFor;
+            if (library.returnBook(title, copy, &heldFor))
+            {
+                cout << "Book '" << title << "' returned." << endl;
+                if (!heldFor.empty())
+                    cout << "It is now checked out to " << heldFor << ", who had it on hold." << endl;
+            }
+            else
+                cout << "That book is not on loan." << endl;
+            break;
+        }
+        case 10:
+        { // Show Overdue and Upcoming Loans
+            vector<Loan> overdue, upcoming;
+            int64_t now = nowSeconds();
+            library.visitLoansDue(INT64_MIN, now, SIZE_MAX, [&](const Loan &loan) { overdue.push_back(loan); });
+            library.visitLoansDue(now, INT64_MAX, 10, [&](const Loan &loan) { upcoming.push_back(loan); });
+            cout << "\n======== OVERDUE LOANS (" << overdue.size() << ") ========\n";
+            displayLoans(overdue);
+            cout << "\n======== NEXT DUE ========\n";
+            displayLoans(upcoming);
+            break;
+        }
+        case 11:
+        { // Show a Patron's Loans
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "\n-- PATRON LOANS --\n";
+            string patron;
+            cout << "Enter the patron's name or card number: ";
+            getline(cin, patron);
+
+            vector<Loan> held;
+            library.visitPatronLoans(patron, [&](const Loan &loan) { held.push_back(loan); });
+            sort(held.begin(), held.end(), [](const Loan &a, const Loan &b) { return a.due < b.due; });
+            displayLoans(held);
+            break;
+        }
+        case 12:
+        { // Place a Hold
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "\n-- PLACE A HOLD --\n";
+            cout << "Enter the exact title of the book: ";
+            getline(cin, title);
+            string patron;
+            cout << "Enter the patron's name or card number: ";
+            getline(cin, patron);
+            int days = getInputInt("Keep the hold for how many days: ");
+
+            Book *book = library.findBook(title);
+            if (!book)
+                cout << "Book not found. Please check the title and try again." << endl;
+            else if (book->available)
+                cout << "That book is available; check it out instead." << endl;
+            else if (patron.empty() || days <= 0 || days > MAX_PERIOD_DAYS)
+                cout << "A patron and a hold period of 1 to " << MAX_PERIOD_DAYS << " days are required." << endl;
+            else if (library.placeHold(title, patron, nowSeconds() + (int64_t)days * 86400))
+                cout << "Hold placed for " << patron << "." << endl;
+            else
+                cout << patron << " already has that book or is waiting for it." << endl;
+            break;
+        }
+        case 13:
+        { // Show or Cancel Holds on a Book
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "\n-- HOLDS ON A BOOK --\n";
+            cout << "Enter the exact title of the book: ";
+            getline(cin, title);
+
+            size_t position = 0;
+            library.visitHolds(title, [&](const Hold &hold) {
+                cout << ++position << ". " << hold.patron << " (until " << formatDate(hold.expires) << ")" << endl;
+            });
+            if (position == 0)
+            {
+                cout << "Nobody is waiting for that book." << endl;
+                break;
+            }
+            string patron;
+            cout << "Enter a patron to cancel their hold (blank to keep all): ";
+            getline(cin, patron);
+            if (!patron.empty())
+                cout << (library.cancelHold(title, patron) ? "Hold cancelled." : "That patron has no hold on it.")
+                     << endl;
+            break;
+        }
+        case 14:
+        { // Manage Copies of a Book
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "\n-- COPIES OF A BOOK --\n";
+            cout << "Enter the exact title of the book: ";
+            getline(cin, title);
+
+            static const char *const statuses[] = {"Available", "On Loan", "Withdrawn"};
+            size_t count = 0;
+            bool found = library.visitCopies(title, [&](const Item &item, const string &branch) {
+                if (count++ == 0)
+                    cout << setw(8) << left << "COPY" << setw(25) << left << "BRANCH" << setw(20) << left
+                         << "CALL NUMBER" << "STATUS" << endl;
+                cout << setw(8) << left << item.copy << setw(25) << left << branch << setw(20) << left
+                     << item.callNumber << statuses[item.status] << endl;
+            });
+            if (!found)
+            {
+                cout << "Book not found. Please check the title and try again." << endl;
+                break;
+            }
+            if (count == 0)
+                cout << "No copies; the book is lent as a single item." << endl;
+
+            cout << "a) Add a copy  r) Remove a copy  w) Withdraw a copy  s) Shelve a withdrawn copy\n";
+            string action, branch, callNumber;
+            cout << "Choice (blank to go back): ";
+            getline(cin, action);
+            if (action == "a")
+            {
+                cout << "Branch: ";
+                getline(cin, branch);
+                cout << "Call number: ";
+                getline(cin, callNumber);
+                uint32_t copy = library.addCopy(title, branch, callNumber);
+                if (copy)
+                    cout << "Added copy " << copy << " at " << branch << "." << endl;
+                else
+                    cout << "A branch is required." << endl;
+            }
+            else if (action == "r" || action == "w" || action == "s")
+            {
+                uint32_t copy = getInputInt("Copy number: ");
+                bool ok = action == "r" ? library.removeCopy(title, copy) : library.setCopyStatus(title, copy, action == "s");
+                cout << (ok ? "Done." : "No such copy, or it is on loan.") << endl;
+            }
+            break;
+        }
+        case 15:
         { // Exit
             cout << "Thank you for using the Library Management System. Goodbye!" << endl;
             running = false;
@@ -585,11 +3485,16 @@ int main()
         }
         default:
         {
-            cout << "Invalid choice. Please enter a number between 1 and 8." << endl;
+            cout << "Invalid choice. Please enter a number between 1 and 15." << endl;
             break;
         }
         }
     }
 
+    if (!library.checkpoint())
+    {
+        cout << "Error: could not write the catalog checkpoint." << endl;
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file